@@ -0,0 +1,204 @@
+#ifndef _GLIM_EXTERNALSORT_HPP_INCLUDED
+#define _GLIM_EXTERNALSORT_HPP_INCLUDED
+
+/**
+ * External (bounded memory) sort of key-value byte records.
+ * @file
+ */
+
+#include <algorithm> // stable_sort
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <stdio.h> // fdopen, fread, fwrite
+#include <stdlib.h> // mkstemp
+#include <string.h> // memcmp, strerror
+#include <unistd.h> // unlink
+#include <errno.h>
+
+#include "gstring.hpp"
+#include "exception.hpp"
+
+namespace glim {
+
+G_DEFINE_EXCEPTION (ExternalSortEx);
+
+/**
+ * Sorts a stream of key-value records which might not fit into memory.\n
+ * Records are buffered until the buffer reaches `memoryLimit` bytes, then the buffer is sorted and spilled into a temporary "run" file;
+ * `merge` does a k-way merge of the runs and the remaining buffer, passing the records to the sink in order.
+ * No more than `maxFanIn` runs are open at once: when there are more, groups of them are first merged into the larger runs.\n
+ * Keys are compared bytewise (`memcmp`, shorter key first), which is the default order both in Leveldb and in LMDB.\n
+ * The sort is stable: records with equal keys come out in the order they were added
+ * (unless `sortValues` is set, then such records are ordered by their values).\n
+ * Run files are unlinked right after creation, they disappear when the `ExternalSort` is destroyed or the process exits.
+ */
+struct ExternalSort {
+  struct Record {uint64_t _offset; uint32_t _klen, _vlen;};
+  std::vector<char> _buf; ///< Keys and values of the buffered records.
+  std::vector<Record> _records;
+  std::vector<std::shared_ptr<FILE>> _runs;
+  size_t _memoryLimit;
+  std::string _tmpDir;
+  bool _sortValues;
+  uint32_t _maxFanIn;
+  uint64_t _count = 0, _bytes = 0;
+  /** The records are passed to the sink as gstring views, which can't be longer than that. */
+  static constexpr uint32_t maxLength = 0xFFFFFF;
+
+  /** @param memoryLimit How many bytes of keys and values to keep in memory before spilling them into a temporary file.
+   * @param tmpDir Where to create the temporary files.
+   * @param sortValues Order records with equal keys by their values (MDB_DUPSORT order).
+   * @param maxFanIn How many run files to merge (and keep open) at once. */
+  ExternalSort (size_t memoryLimit = 64 * 1024 * 1024, std::string tmpDir = "/tmp", bool sortValues = false, uint32_t maxFanIn = 64):
+    _memoryLimit (memoryLimit), _tmpDir (tmpDir), _sortValues (sortValues), _maxFanIn (std::max (maxFanIn, 2u)) {}
+  ExternalSort (const ExternalSort&) = delete;
+  ExternalSort (ExternalSort&&) = default;
+
+  static int compare (const char* a, uint32_t alen, const char* b, uint32_t blen) noexcept {
+    int cmp = ::memcmp (a, b, std::min (alen, blen));
+    return cmp ? cmp : (alen < blen ? -1 : (alen > blen ? 1 : 0));
+  }
+
+  /** Adds a record, spilling the buffer to a run file if it grows over the `memoryLimit`.
+   * Throws `ExternalSortEx` if the key or the value is longer than `maxLength`. */
+  void add (const char* key, uint32_t klen, const char* value, uint32_t vlen) {
+    if (klen > maxLength || vlen > maxLength) GNTHROW (ExternalSortEx, "ExternalSort: the key or the value is longer than 16 MiB");
+    Record rec; rec._offset = _buf.size(); rec._klen = klen; rec._vlen = vlen;
+    _buf.insert (_buf.end(), key, key + klen);
+    _buf.insert (_buf.end(), value, value + vlen);
+    _records.push_back (rec);
+    ++_count; _bytes += klen + vlen;
+    if (_buf.size() + _records.size() * sizeof (Record) >= _memoryLimit) spill();
+  }
+  void add (const gstring& key, const gstring& value) {add (key.data(), key.size(), value.data(), value.size());}
+
+  /** The number of records added. */
+  uint64_t count() const noexcept {return _count;}
+  /** The number of key and value bytes added. */
+  uint64_t bytes() const noexcept {return _bytes;}
+
+ protected:
+  void sortBuffer() {
+    const char* buf = _buf.data(); const bool sortValues = _sortValues;
+    std::stable_sort (_records.begin(), _records.end(), [buf,sortValues] (const Record& a, const Record& b) {
+      const char* ak = buf + a._offset; const char* bk = buf + b._offset;
+      int cmp = compare (ak, a._klen, bk, b._klen);
+      if (cmp == 0 && sortValues) cmp = compare (ak + a._klen, a._vlen, bk + b._klen, b._vlen);
+      return cmp < 0;});
+  }
+
+  /** Creates an (unlinked) temporary file for a run. */
+  std::shared_ptr<FILE> createRun() {
+    std::string path = _tmpDir + "/glimExternalSort.XXXXXX";
+    int fd = ::mkstemp (&path[0]);
+    if (fd == -1) GNTHROW (ExternalSortEx, "mkstemp (" + path + "): " + ::strerror (errno));
+    ::unlink (path.c_str());
+    FILE* file = ::fdopen (fd, "w+b");
+    if (!file) {::close (fd); GNTHROW (ExternalSortEx, std::string ("fdopen: ") + ::strerror (errno));}
+    return std::shared_ptr<FILE> (file, ::fclose);
+  }
+  static void writeRecord (FILE* file, const char* key, uint32_t klen, const char* value, uint32_t vlen) {
+    uint32_t lens[2] = {klen, vlen};
+    if (::fwrite (lens, sizeof (lens), 1, file) != 1 ||
+        (klen && ::fwrite (key, klen, 1, file) != 1) || (vlen && ::fwrite (value, vlen, 1, file) != 1))
+      GNTHROW (ExternalSortEx, std::string ("Can't write the run: ") + ::strerror (errno));
+  }
+  static void rewindRun (FILE* file) {
+    if (::fflush (file) || ::fseek (file, 0, SEEK_SET)) GNTHROW (ExternalSortEx, std::string ("Can't rewind the run: ") + ::strerror (errno));
+  }
+
+  /** Sorts the buffer and writes it into a new run file. */
+  void spill() {
+    if (_records.empty()) return;
+    sortBuffer();
+    std::shared_ptr<FILE> run (createRun());
+    for (const Record& rec: _records) {
+      const char* data = _buf.data() + rec._offset;
+      writeRecord (run.get(), data, rec._klen, data + rec._klen, rec._vlen);
+    }
+    rewindRun (run.get());
+    _runs.push_back (run);
+    _buf.clear(); _records.clear();
+  }
+
+  /** Reads the records of a run file sequentially. */
+  struct RunReader {
+    FILE* _file; uint32_t _run; std::string _bytes; uint32_t _klen = 0;
+    RunReader (FILE* file, uint32_t run): _file (file), _run (run) {}
+    bool next() {
+      uint32_t lens[2];
+      if (::fread (lens, sizeof (lens), 1, _file) != 1) {
+        if (::ferror (_file)) GNTHROW (ExternalSortEx, "Can't read the run");
+        return false;
+      }
+      if (lens[0] > maxLength || lens[1] > maxLength) GNTHROW (ExternalSortEx, "Corrupted run");
+      _klen = lens[0]; _bytes.resize ((size_t) lens[0] + lens[1]);
+      if (!_bytes.empty() && ::fread (&_bytes[0], _bytes.size(), 1, _file) != 1) GNTHROW (ExternalSortEx, "Truncated run");
+      return true;
+    }
+    gstring key() const {return gstring (0, (void*) _bytes.data(), false, _klen);}
+    gstring value() const {return gstring (0, (void*) (_bytes.data() + _klen), false, _bytes.size() - _klen);}
+  };
+
+  /** K-way merge of the runs [`from`, `till`) into the `sink`. */
+  template <typename Sink> void mergeRuns (size_t from, size_t till, Sink& sink) {
+    std::vector<RunReader> readers; readers.reserve (till - from);
+    for (size_t run = from; run < till; ++run) readers.emplace_back (_runs[run].get(), (uint32_t) run);
+    const bool sortValues = _sortValues;
+    // NB: `priority_queue` puts the "largest" element on top, hence the inverted comparison.
+    auto greater = [sortValues] (const RunReader* a, const RunReader* b) {
+      int cmp = compare (a->_bytes.data(), a->_klen, b->_bytes.data(), b->_klen);
+      if (cmp == 0 && sortValues) cmp = compare (a->_bytes.data() + a->_klen, a->_bytes.size() - a->_klen, b->_bytes.data() + b->_klen, b->_bytes.size() - b->_klen);
+      return cmp ? cmp > 0 : a->_run > b->_run;}; // Earlier runs first, keeping the sort stable.
+    std::priority_queue<RunReader*, std::vector<RunReader*>, decltype (greater)> heap (greater);
+    for (RunReader& reader: readers) if (reader.next()) heap.push (&reader);
+    while (!heap.empty()) {
+      RunReader* reader = heap.top(); heap.pop();
+      sink (reader->key(), reader->value());
+      if (reader->next()) heap.push (reader);
+    }
+  }
+
+ public:
+  /** Passes all the records to `sink (const gstring& key, const gstring& value)` in the sorted order.\n
+   * The gstrings are only valid during the `sink` invocation.\n
+   * The sorter is empty afterwards and can be reused. */
+  template <typename Sink> void merge (Sink sink) {
+    if (_runs.empty()) { // Everything fits into memory.
+      sortBuffer();
+      for (const Record& rec: _records) {
+        char* data = _buf.data() + rec._offset;
+        sink (gstring (0, data, false, rec._klen), gstring (0, data + rec._klen, false, rec._vlen));
+      }
+      _buf.clear(); _records.clear();
+      return;
+    }
+    spill();
+
+    // Intermediate passes. The merged groups are the adjacent runs, which keeps the sort stable.
+    while (_runs.size() > _maxFanIn) {
+      std::vector<std::shared_ptr<FILE>> merged;
+      for (size_t from = 0; from < _runs.size(); from += _maxFanIn) {
+        const size_t till = std::min (from + _maxFanIn, _runs.size());
+        if (till - from == 1) {merged.push_back (_runs[from]); continue;}
+        std::shared_ptr<FILE> run (createRun()); FILE* file = run.get();
+        auto write = [file] (const gstring& key, const gstring& value) {writeRecord (file, key.data(), key.size(), value.data(), value.size());};
+        mergeRuns (from, till, write);
+        rewindRun (file);
+        merged.push_back (run);
+        for (size_t num = from; num < till; ++num) _runs[num].reset(); // Free the descriptors and the disk space early.
+      }
+      _runs.swap (merged);
+    }
+    mergeRuns (0, _runs.size(), sink);
+    _runs.clear();
+  }
+};
+
+} // namespace glim
+
+#endif // _GLIM_EXTERNALSORT_HPP_INCLUDED
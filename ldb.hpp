@@ -24,11 +24,21 @@ limitations under the License.
 #include <string>
 //#include <unordered_map> // having SIGFPE as in http://stackoverflow.com/q/13580823/257568
 #include <map>
+#include <vector>
+#include <algorithm> // max
+#include <memory>
+#include <thread>
+#include <exception> // exception_ptr
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <climits> // CHAR_MAX
 
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 #include <leveldb/filter_policy.h>
+#include <leveldb/cache.h>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/serialization/serialization.hpp>
@@ -39,12 +49,18 @@ limitations under the License.
 #include <arpa/inet.h> // htonl, ntohl
 #include <sys/stat.h> // mkdir
 #include <sys/types.h> // mkdir
+#include <dirent.h> // opendir
+#include <unistd.h> // link, fsync
 #include <string.h> // strerror
 #include <errno.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // strtoull, atoi
+#include <time.h>
 #include <sstream>
 
 #include "gstring.hpp"
 #include "exception.hpp"
+#include "ExternalSort.hpp"
 
 namespace glim {
 
@@ -91,6 +107,49 @@ template <> inline void ldbDeserialize<std::string> (const gstring& bytes, std::
 struct Ldb {
   std::shared_ptr<leveldb::DB> _db;
   std::shared_ptr<const leveldb::FilterPolicy> _filter;
+  std::string _path; ///< Database directory, empty if the Ldb was made from a `leveldb::DB`.
+
+  /** LRU block cache counting the lookup hits and misses. */
+  struct CountingCache: public leveldb::Cache {
+    std::unique_ptr<leveldb::Cache> _lru;
+    size_t _capacity;
+    std::atomic<uint64_t> _hits {0}, _misses {0};
+    CountingCache (size_t capacity): _lru (leveldb::NewLRUCache (capacity)), _capacity (capacity) {}
+    virtual Handle* Insert (const leveldb::Slice& key, void* value, size_t charge, void (*deleter) (const leveldb::Slice& key, void* value)) override {
+      return _lru->Insert (key, value, charge, deleter);}
+    virtual Handle* Lookup (const leveldb::Slice& key) override {
+      Handle* handle = _lru->Lookup (key);
+      if (handle) _hits.fetch_add (1, std::memory_order_relaxed); else _misses.fetch_add (1, std::memory_order_relaxed);
+      return handle;}
+    virtual void Release (Handle* handle) override {_lru->Release (handle);}
+    virtual void* Value (Handle* handle) override {return _lru->Value (handle);}
+    virtual void Erase (const leveldb::Slice& key) override {_lru->Erase (key);}
+    virtual uint64_t NewId() override {return _lru->NewId();}
+    virtual void Prune() override {_lru->Prune();}
+    virtual size_t TotalCharge() const override {return _lru->TotalCharge();}
+  };
+  std::shared_ptr<CountingCache> _cache;
+
+  /** Database tuning for the `Ldb` constructor.\n
+   * Example: \code glim::Ldb ldb ("/var/lib/foo", glim::Ldb::Options().cacheMb (512) .bloomBits (10) .blockSize (16 * 1024)); \endcode */
+  struct Options {
+    size_t _cacheBytes = 8 * 1024 * 1024; ///< LRU block cache. Leveldb's default is 8 MiB.
+    size_t _writeBufferBytes = 4 * 1024 * 1024; ///< Memtable size. Leveldb's default is 4 MiB.
+    size_t _blockSize = 4096; ///< Uncompressed size of a table block.
+    size_t _maxFileSize = 2 * 1024 * 1024; ///< Size of a table file.
+    int _maxOpenFiles = 1000;
+    int _bloomBits = 8; ///< Bits per key in the Bloom filter, 0 to disable the filter.
+    leveldb::CompressionType _compression = leveldb::kSnappyCompression;
+    bool _paranoidChecks = false;
+    Options& cacheMb (size_t mb) {_cacheBytes = mb * 1024 * 1024; return *this;}
+    Options& writeBufferMb (size_t mb) {_writeBufferBytes = mb * 1024 * 1024; return *this;}
+    Options& blockSize (size_t bytes) {_blockSize = bytes; return *this;}
+    Options& maxFileSizeMb (size_t mb) {_maxFileSize = mb * 1024 * 1024; return *this;}
+    Options& maxOpenFiles (int files) {_maxOpenFiles = files; return *this;}
+    Options& bloomBits (int bitsPerKey) {_bloomBits = bitsPerKey; return *this;}
+    Options& compression (bool snappy) {_compression = snappy ? leveldb::kSnappyCompression : leveldb::kNoCompression; return *this;}
+    Options& paranoidChecks (bool paranoid) {_paranoidChecks = paranoid; return *this;}
+  };
 
   struct IteratorEntry { ///< Something to be `dereference`d from the Iterator. Also a pImpl allowing to keep the `_valid` and the `_lit` in sync.
     leveldb::Iterator* _lit;
@@ -150,6 +209,7 @@ struct Ldb {
     bool end() const {return !_entry->_valid;}
 
     bool equal (const Iterator& other) const {
+      if (_entry == other._entry) return true; // Copies of the same iterator.
       bool weAreValid = _entry->_valid, theyAreValid = other._entry->_valid;
       if (!weAreValid) return !theyAreValid;
       if (!theyAreValid) return false;
@@ -259,6 +319,179 @@ struct Ldb {
       StartsWithIterator (this, kbytes.data(), kbytes.length(), NoSeekFlag()));
   }
 
+  /** Lean forward-only cursor: a single Leveldb iterator checked against an upper bound or a prefix.\n
+   * Unlike the `Iterator` it has no shared state, no virtual calls and no key comparisons other than the bound check,
+   * which makes it a better fit for the tight scans. It can be moved but not copied.\n
+   * Example: \code
+   *   for (auto cur = ldb.cursor (C2GSTRING ("a"), C2GSTRING ("b"), false); cur.valid(); cur.next()) total += cur.valueView().size();
+   * \endcode */
+  struct Cursor {
+    std::unique_ptr<leveldb::Iterator> _lit;
+    gstring _bound; ///< Exclusive upper bound or the prefix, empty for no bound.
+    bool _prefix = false; ///< Whether the `_bound` is a prefix.
+    bool _valid = false;
+
+    Cursor (leveldb::Iterator* lit, gstring&& bound, bool prefix): _lit (lit), _bound (std::move (bound)), _prefix (prefix) {}
+    Cursor (Cursor&&) = default;
+    Cursor& operator= (Cursor&&) = default;
+
+    bool valid() const noexcept {return _valid;}
+    /** Checks the current position against the bound. */
+    void check() {
+      _valid = _lit->Valid();
+      if (_valid && !_bound.empty()) {
+        const leveldb::Slice bound (_bound.data(), _bound.size());
+        _valid = _prefix ? _lit->key().starts_with (bound) : _lit->key().compare (bound) < 0;
+      }
+    }
+    void next() {_lit->Next(); check();}
+    /** Positions the cursor at the first key at or after `kbytes`. */
+    void seek (const gstring& kbytes) {_lit->Seek (leveldb::Slice (kbytes.data(), kbytes.size())); check();}
+    /** Throws if the underlying iterator has encountered an error. */
+    void checkStatus() const {if (!_lit->status().ok()) GNTHROW (LdbEx, "Ldb.Cursor: " + _lit->status().ToString());}
+
+    /** Zero-copy view of the current key bytes, valid until the cursor moves. */
+    const gstring keyView() const {const leveldb::Slice key (_lit->key()); return gstring (0, (void*) key.data(), false, key.size(), true);}
+    /** Zero-copy view of the current value bytes, valid until the cursor moves. */
+    const gstring valueView() const {const leveldb::Slice val (_lit->value()); return gstring (0, (void*) val.data(), false, val.size(), true);}
+    template <typename T> void getKey (T& key) const {ldbDeserialize (keyView(), key);}
+    template <typename T> T getKey() const {T key; getKey (key); return key;}
+    template <typename T> void getValue (T& value) const {ldbDeserialize (valueView(), value);}
+    template <typename T> T getValue() const {T value; getValue (value); return value;}
+  };
+  /** Cursor over the [`from`, `till`) range.
+   * @param fillCache Set to `false` for the large scans, in order not to push the hot blocks out of the block cache. */
+  template <typename K> Cursor cursor (const K& from, const K& till, bool fillCache = true, leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    options.fill_cache = fillCache;
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    ldbSerialize (kbytes, till);
+    Cursor cur (_db->NewIterator (options), kbytes.clone(), false);
+    ldbSerialize (kbytes.clear(), from);
+    cur.seek (kbytes);
+    return cur;
+  }
+  /** Cursor over the entries starting with `prefix`. */
+  template <typename K> Cursor prefixCursor (const K& prefix, bool fillCache = true, leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    options.fill_cache = fillCache;
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    ldbSerialize (kbytes, prefix);
+    Cursor cur (_db->NewIterator (options), kbytes.clone(), true);
+    cur.seek (kbytes);
+    return cur;
+  }
+  /** Cursor over the whole database. */
+  Cursor cursor (bool fillCache = true, leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    options.fill_cache = fillCache;
+    Cursor cur (_db->NewIterator (options), gstring(), false);
+    cur._lit->SeekToFirst(); cur.check();
+    return cur;
+  }
+
+  /** Leveldb snapshot, released when the last copy of the pointer is gone. */
+  std::shared_ptr<const leveldb::Snapshot> snapshot() {
+    std::shared_ptr<leveldb::DB> db (_db);
+    return std::shared_ptr<const leveldb::Snapshot> (db->GetSnapshot(), [db] (const leveldb::Snapshot* snapshot) {db->ReleaseSnapshot (snapshot);});
+  }
+
+  /** Splits the [`from`, `till`) range of serialized keys into `parts` sub-ranges of about equal size on disk.\n
+   * Uses `GetApproximateSizes` to bisect the key space right after the common prefix of `from` and `till`;
+   * falls back to splitting the key space evenly when Leveldb can't estimate (e.g. when the data is still in the memtable).\n
+   * Returns the boundaries: `from`, the split keys (ascending, possibly fewer than `parts - 1` of them) and `till`.\n
+   * An empty `till` stands for the end of the database. */
+  std::vector<gstring> splitRange (const gstring& from, const gstring& till, uint32_t parts) {
+    std::vector<gstring> bounds; bounds.reserve (parts + 1);
+    bounds.push_back (from.clone());
+    if (parts > 1) {
+      uint32_t prefix = 0; if (!till.empty()) while (prefix < from.size() && prefix < till.size() && from[prefix] == till[prefix]) ++prefix;
+      // Keys after the common prefix are treated as 64-bit big-endian fractions.
+      auto fraction = [prefix] (const gstring& key, uint64_t ifEmpty) -> uint64_t {
+        if (key.empty()) return ifEmpty;
+        uint64_t fr = 0; for (uint32_t pos = prefix; pos < prefix + 8; ++pos) fr = (fr << 8) | (pos < key.size() ? (uint8_t) key[pos] : 0);
+        return fr;};
+      const uint64_t lo = fraction (from, 0), hi = fraction (till, UINT64_MAX);
+      std::string kbuf (from.data(), prefix); kbuf.resize (prefix + 8);
+      auto keyAt = [&] (uint64_t fr) -> leveldb::Slice {
+        for (int pos = 7; pos >= 0; --pos) {kbuf[prefix + pos] = (char) (fr & 0xFF); fr >>= 8;}
+        return leveldb::Slice (kbuf.data(), prefix + 8);};
+      leveldb::Slice fromSlice (from.data(), from.size());
+      auto sizeTill = [&] (const leveldb::Slice& limit) -> uint64_t {
+        leveldb::Range range (fromSlice, limit); uint64_t size = 0; _db->GetApproximateSizes (&range, 1, &size); return size;};
+      const uint64_t total = till.empty() ? sizeTill (keyAt (UINT64_MAX)) : sizeTill (leveldb::Slice (till.data(), till.size()));
+      uint64_t prev = lo;
+      for (uint32_t part = 1; part < parts && hi > lo; ++part) {
+        uint64_t split;
+        if (total == 0) split = lo + (hi - lo) / parts * part;
+        else { // Bisect for the point where the approximate size reaches `part / parts` of the total.
+          const uint64_t target = total / parts * part;
+          uint64_t left = prev, right = hi;
+          while (right - left > 1) {uint64_t mid = left + (right - left) / 2; if (sizeTill (keyAt (mid)) < target) left = mid; else right = mid;}
+          split = right;
+        }
+        if (split <= prev || split >= hi) continue;
+        leveldb::Slice key (keyAt (split));
+        if (key.compare (fromSlice) <= 0) continue;
+        bounds.push_back (gstring (key.data(), key.size()));
+        prev = split;
+      }
+    }
+    bounds.push_back (till.clone());
+    return bounds;
+  }
+
+  /** Scans the [`from`, `till`) range on `threads` threads, each thread getting a sub-range of about equal size (see `splitRange`).\n
+   * All the threads read from the same snapshot (`options.snapshot` or a fresh one).\n
+   * Every thread starts with a copy of the `identity` and calls `visitor (R& partial, IteratorEntry& entry)` for the entries in its sub-range;
+   * the partial results are then folded in key order with `reducer (R& result, R& partial)`, starting with `init`
+   * (thus `init` is counted once, however many the threads).\n
+   * If a thread throws then the first exception is rethrown after all the threads are joined.
+   * Example: \code
+   *   uint64_t bytes = ldb.parallelRange (C2GSTRING ("a"), C2GSTRING ("b"), (uint64_t) 0, (uint64_t) 0,
+   *     [](uint64_t& sum, Ldb::IteratorEntry& entry) {sum += entry.valueView().size();},
+   *     [](uint64_t& sum, uint64_t& partial) {sum += partial;});
+   * \endcode
+   * @param identity The neutral element of the `reducer` (zero for a sum, the largest value for a minimum).
+   * @param threads The number of sub-ranges and threads, `std::thread::hardware_concurrency` by default. */
+  template <typename K, typename R, typename Visitor, typename Reducer>
+  R parallelRange (const K& from, const K& till, R init, const R& identity, Visitor visitor, Reducer reducer, uint32_t threads = 0,
+                   leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    char fbuf[64]; gstring fbytes (sizeof (fbuf), fbuf, false, 0); ldbSerialize (fbytes, from);
+    char tbuf[64]; gstring tbytes (sizeof (tbuf), tbuf, false, 0); ldbSerialize (tbytes, till);
+    if (threads == 0) threads = std::max (1u, std::thread::hardware_concurrency());
+
+    std::shared_ptr<const leveldb::Snapshot> snapshot;
+    if (!options.snapshot) {snapshot = this->snapshot(); options.snapshot = snapshot.get();}
+    const std::vector<gstring> bounds (splitRange (fbytes, tbytes, threads));
+    const uint32_t parts = bounds.size() - 1;
+
+    std::vector<R> partials (parts, identity);
+    std::vector<std::exception_ptr> errors (parts);
+    auto scan = [&] (uint32_t part) {
+      try {
+        IteratorEntry entry (_db->NewIterator (options));
+        const gstring& start = bounds[part]; const gstring& limit = bounds[part + 1];
+        const leveldb::Slice limitSlice (limit.data(), limit.size());
+        // NB: An empty `till` means "till the end", but an empty `from` is just the lowest key.
+        const bool unbounded = part == parts - 1 && limit.empty();
+        leveldb::Iterator* lit = entry._lit;
+        for (lit->Seek (leveldb::Slice (start.data(), start.size())); lit->Valid(); lit->Next()) {
+          if (!unbounded && lit->key().compare (limitSlice) >= 0) break;
+          entry._valid = true;
+          visitor (partials[part], entry);
+        }
+        entry._valid = false;
+        if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.parallelRange: " + lit->status().ToString());
+      } catch (...) {errors[part] = std::current_exception();}
+    };
+    std::vector<std::thread> workers; workers.reserve (parts);
+    for (uint32_t part = 1; part < parts; ++part) workers.emplace_back (scan, part);
+    scan (0); // Use the current thread for the first sub-range.
+    for (auto& worker: workers) worker.join();
+
+    for (auto& error: errors) if (error) std::rethrow_exception (error);
+    for (auto& partial: partials) reducer (init, partial);
+    return init;
+  }
+
   struct Trigger {
     virtual gstring triggerName() const {return C2GSTRING ("defaultTriggerName");};
     virtual void put (Ldb& ldb, void* key, gstring& kbytes, void* value, gstring& vbytes, leveldb::WriteBatch& batch) = 0;
@@ -271,30 +504,552 @@ struct Ldb {
     _triggers[trigger->triggerName()] = trigger;
   }
 
+  /** Keys used by the wrapper itself (the change log, the trigger progress) start with this prefix.\n
+   * It sorts after the ASCII and UTF-8 keys (0xFF never occurs in UTF-8). */
+  static gstring systemPrefix() noexcept {return C2GSTRING ("\xFF" "glim" "\xFF");}
+  /** Appends `num` in big-endian (lexicographically ordered) form. */
+  static void appendBigEndian (gstring& bytes, uint64_t num) {
+    char buf[8]; for (int pos = 7; pos >= 0; --pos) {buf[pos] = (char) (num & 0xFF); num >>= 8;}
+    bytes.append (buf, 8);}
+  /** Reads a big-endian number written with `appendBigEndian`. */
+  static uint64_t bigEndianAt (const char* bytes) noexcept {
+    uint64_t num = 0; for (int pos = 0; pos < 8; ++pos) num = (num << 8) | (uint8_t) bytes[pos];
+    return num;}
+
+  /** An entry of the change log. The gstrings point into the log record. */
+  struct Change {
+    uint64_t _seq = 0;
+    char _op = 0; ///< 'P' for put or 'D' for delete.
+    gstring _key, _value;
+    bool _haveOld = false; ///< Whether the `_oldValue` was captured (see `AsyncTrigger::wantsOldValues`).
+    bool _hadOld = false; ///< Whether the key existed before the change.
+    gstring _oldValue;
+    /** Parses the change log record. */
+    void parse (uint64_t seq, const gstring& record) {
+      if (record.size() < 2) GNTHROW (LdbEx, "Ldb.Change: record too short");
+      _seq = seq; _op = record[0]; _haveOld = record[1] & 1; _hadOld = record[1] & 2;
+      uint32_t pos = 2; _key = record.netstringAt (pos, &pos);
+      _value = _op == 'P' ? record.netstringAt (pos, &pos) : gstring();
+      _oldValue = _haveOld && _hadOld ? record.netstringAt (pos, &pos) : gstring();
+    }
+  };
+
+  /** Trigger running on a background thread, off the change log.\n
+   * Changes are applied in sequence order; the trigger's progress is stored in the same `WriteBatch` as the trigger's own writes,
+   * therefore after a crash the trigger resumes where it has stopped. */
+  struct AsyncTrigger {
+    virtual gstring triggerName() const {return C2GSTRING ("defaultAsyncTriggerName");};
+    /** If `true` then the writers will capture the previous values of the changed keys into the log, costing a `Get` per mutation.
+     * Usually needed to remove the stale index entries. */
+    virtual bool wantsOldValues() const {return false;}
+    /** Add the index updates for the `change` into the `batch`. */
+    virtual void apply (Ldb& ldb, const Change& change, leveldb::WriteBatch& batch) = 0;
+    virtual ~AsyncTrigger() {}
+  };
+
+  /** State of the change log and the async triggers, shared between the copies of an Ldb.\n
+   * Allocated with the Ldb, so that the copies made before the log is enabled log their writes too. */
+  struct ChangeLog {
+    std::once_flag _restored; ///< `_lastSeq` is restored from the database when the log is first used.
+    std::mutex _writeMutex; ///< Keeps the log sequence in the commit order.
+    std::atomic<uint64_t> _lastSeq {0}; ///< Last committed change.
+    std::atomic<bool> _oldValues {false};
+    std::atomic<bool> _enabled {false}; ///< Set by `putAsyncTrigger` and `retainChanges`; the changes are logged from then on (cf. `stopLogging`).
+    std::mutex _mutex; ///< Guards `_workers` and backs `_cond`.
+    std::condition_variable _cond; ///< Signalled on new changes and trigger progress.
+    struct Worker {
+      std::shared_ptr<AsyncTrigger> _trigger;
+      std::atomic<uint64_t> _applied {0};
+      std::exception_ptr _error;
+      std::thread _thread;
+    };
+    std::vector<std::unique_ptr<Worker>> _workers;
+    bool _stop = false;
+    std::mutex _trimMutex; uint64_t _trimmed = 0;
+    std::atomic<uint64_t> _retained {UINT64_MAX}; ///< Changes after this sequence are kept for `exportChanges`.
+
+    void stop() {
+      {std::lock_guard<std::mutex> lock (_mutex); _stop = true;}
+      _cond.notify_all();
+      for (auto& worker: _workers) if (worker->_thread.joinable()) worker->_thread.join();
+      std::lock_guard<std::mutex> lock (_mutex); _workers.clear(); _stop = false;
+    }
+    ~ChangeLog() {stop();}
+  };
+  std::shared_ptr<ChangeLog> _changes = std::make_shared<ChangeLog>();
+
+ protected:
+  static gstring changePrefix() {gstring prefix (systemPrefix()); prefix.owned() << "chg"; return prefix;}
+  static gstring progressKey (const gstring& triggerName) {gstring key (systemPrefix()); key.owned() << "trg" << triggerName; return key;}
+
+  /** Returns the `_changes`, restoring the log sequence from the database on the first call. */
+  ChangeLog* changeLog() {
+    ChangeLog* log = _changes.get();
+    std::call_once (log->_restored, [this,log]() {restoreLastSeq (log);});
+    return log;
+  }
+  void restoreLastSeq (ChangeLog* log) {
+    uint64_t lastSeq = 0;
+    std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (leveldb::ReadOptions()));
+    const gstring prefix (changePrefix());
+    gstring after (prefix.clone()); after << "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
+    lit->Seek (leveldb::Slice (after.data(), after.size()));
+    if (lit->Valid()) lit->Prev(); else lit->SeekToLast();
+    if (lit->Valid() && lit->key().starts_with (leveldb::Slice (prefix.data(), prefix.size())) && lit->key().size() == prefix.size() + 8)
+      lastSeq = bigEndianAt (lit->key().data() + prefix.size());
+    // The log might have been trimmed completely, the trigger progress is the other source of the sequence.
+    const gstring trg (progressKey (gstring()));
+    for (lit->Seek (leveldb::Slice (trg.data(), trg.size())); lit->Valid() && lit->key().starts_with (leveldb::Slice (trg.data(), trg.size())); lit->Next())
+      if (lit->value().size() == 8) lastSeq = std::max (lastSeq, bigEndianAt (lit->value().data()));
+    log->_lastSeq = lastSeq; log->_trimmed = 0;
+  }
+
+  /** Writes the `batch` together with the change log records for it. */
+  void writeLogged (ChangeLog* log, leveldb::WriteBatch& batch, const leveldb::WriteOptions& options) {
+    struct Handler: public leveldb::WriteBatch::Handler {
+      Ldb* _ldb; leveldb::WriteBatch _logged; uint64_t _seq; bool _oldValues;
+      gstring _sys, _prefix, _key, _record; std::string _old;
+      void change (char op, const leveldb::Slice& key, const leveldb::Slice* value) {
+        if (key.starts_with (leveldb::Slice (_sys.data(), _sys.size()))) return; // Our own bookkeeping.
+        _record.clear(); _record << op;
+        bool hadOld = false;
+        if (_oldValues) {
+          leveldb::Status status (_ldb->_db->Get (leveldb::ReadOptions(), key, &_old));
+          if (status.ok()) hadOld = true; else if (!status.IsNotFound()) GNTHROW (LdbEx, "Ldb.write: " + status.ToString());
+        }
+        _record << (char) ((_oldValues ? 1 : 0) | (hadOld ? 2 : 0));
+        _record.appendNetstring (key.data(), key.size());
+        if (value) _record.appendNetstring (value->data(), value->size());
+        if (hadOld) _record.appendNetstring (_old.data(), _old.size());
+        _key.clear() << _prefix; appendBigEndian (_key, ++_seq);
+        _logged.Put (leveldb::Slice (_key.data(), _key.size()), leveldb::Slice (_record.data(), _record.size()));
+      }
+      virtual void Put (const leveldb::Slice& key, const leveldb::Slice& value) override {
+        change ('P', key, &value); _logged.Put (key, value);}
+      virtual void Delete (const leveldb::Slice& key) override {
+        change ('D', key, nullptr); _logged.Delete (key);}
+    } handler;
+    handler._ldb = this; handler._sys = systemPrefix(); handler._prefix = changePrefix(); handler._oldValues = log->_oldValues;
+
+    std::lock_guard<std::mutex> lock (log->_writeMutex);
+    if (!log->_enabled) { // Turned off by `stopLogging` meanwhile.
+      leveldb::Status status (_db->Write (options, &batch));
+      if (!status.ok()) GNTHROW (LdbEx, status.ToString());
+      return;}
+    handler._seq = log->_lastSeq;
+    leveldb::Status status (batch.Iterate (&handler));
+    if (status.ok()) status = _db->Write (options, &handler._logged);
+    if (!status.ok()) GNTHROW (LdbEx, status.ToString());
+    {std::lock_guard<std::mutex> lock (log->_mutex); log->_lastSeq = handler._seq;}
+    log->_cond.notify_all();
+  }
+
+  /** Removes the log records which were applied by all the async triggers. */
+  static void trimChanges (leveldb::DB* db, ChangeLog* log) {
+    uint64_t upto = log->_retained;
+    {std::lock_guard<std::mutex> lock (log->_mutex);
+      for (auto& worker: log->_workers) upto = std::min (upto, worker->_applied.load());}
+    if (upto == UINT64_MAX) return;
+    trimChangesUpto (db, log, upto);
+  }
+  /** Removes the log records up to and including the `upto` sequence number. */
+  static void trimChangesUpto (leveldb::DB* db, ChangeLog* log, uint64_t upto) {
+    std::lock_guard<std::mutex> lock (log->_trimMutex);
+    if (upto <= log->_trimmed) return;
+    const gstring prefix (changePrefix());
+    gstring from (prefix.clone()); appendBigEndian (from, log->_trimmed + 1);
+    leveldb::WriteBatch batch;
+    std::unique_ptr<leveldb::Iterator> lit (db->NewIterator (leveldb::ReadOptions()));
+    for (lit->Seek (leveldb::Slice (from.data(), from.size())); lit->Valid(); lit->Next()) {
+      const leveldb::Slice key (lit->key());
+      if (!key.starts_with (leveldb::Slice (prefix.data(), prefix.size())) || key.size() != prefix.size() + 8) break;
+      if (bigEndianAt (key.data() + prefix.size()) > upto) break;
+      batch.Delete (key);
+    }
+    leveldb::Status status (db->Write (leveldb::WriteOptions(), &batch));
+    if (status.ok()) log->_trimmed = upto;
+  }
+
+  /** Turns the change log off and removes its records if there is no consumer left for them:
+   * no async trigger running and no changes retained for `exportChanges`. */
+  void stopLogging (ChangeLog* log) {
+    uint64_t upto;
+    {std::lock_guard<std::mutex> writeLock (log->_writeMutex);
+      std::lock_guard<std::mutex> lock (log->_mutex);
+      if (!log->_enabled || !log->_workers.empty() || log->_retained != UINT64_MAX) return;
+      log->_enabled = false; upto = log->_lastSeq;}
+    trimChangesUpto (_db.get(), log, upto);
+  }
+
+  /** Background loop of an async trigger. */
+  static void asyncTriggerLoop (std::shared_ptr<leveldb::DB> db, ChangeLog* log, ChangeLog::Worker* worker) {
+    Ldb ldb (db); // A plain Ldb for the trigger to use, without triggers of its own.
+    const gstring prefix (changePrefix());
+    const gstring progress (progressKey (worker->_trigger->triggerName()));
+    gstring from; Change change;
+    try {
+      for (;;) {
+        uint64_t applied = worker->_applied;
+        {std::unique_lock<std::mutex> lock (log->_mutex);
+          log->_cond.wait (lock, [&]() {return log->_stop || applied < log->_lastSeq;});
+          if (log->_stop) return;}
+        const uint64_t till = log->_lastSeq;
+
+        leveldb::WriteBatch batch; uint64_t seq = applied; uint32_t count = 0;
+        std::unique_ptr<leveldb::Iterator> lit (db->NewIterator (leveldb::ReadOptions()));
+        from.clear() << prefix; appendBigEndian (from, applied + 1);
+        for (lit->Seek (leveldb::Slice (from.data(), from.size())); lit->Valid() && count < 1024; lit->Next()) {
+          const leveldb::Slice key (lit->key());
+          if (!key.starts_with (leveldb::Slice (prefix.data(), prefix.size())) || key.size() != prefix.size() + 8) break;
+          uint64_t recSeq = bigEndianAt (key.data() + prefix.size()); if (recSeq > till) break;
+          const leveldb::Slice val (lit->value());
+          change.parse (recSeq, gstring (0, (void*) val.data(), false, val.size()));
+          worker->_trigger->apply (ldb, change, batch);
+          seq = recSeq; ++count;
+        }
+        if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.asyncTrigger: " + lit->status().ToString());
+        if (count == 0) seq = till; // Nothing left in the log up to `till`.
+        from.clear(); appendBigEndian (from, seq);
+        batch.Put (leveldb::Slice (progress.data(), progress.size()), leveldb::Slice (from.data(), from.size()));
+        lit.reset();
+        leveldb::Status status (db->Write (leveldb::WriteOptions(), &batch));
+        if (!status.ok()) GNTHROW (LdbEx, "Ldb.asyncTrigger: " + status.ToString());
+
+        {std::lock_guard<std::mutex> lock (log->_mutex); worker->_applied = seq;}
+        log->_cond.notify_all();
+        trimChanges (db.get(), log);
+      }
+    } catch (...) {
+      {std::lock_guard<std::mutex> lock (log->_mutex); worker->_error = std::current_exception();}
+      log->_cond.notify_all();
+    }
+  }
+ public:
+
+  /** Registers the asynchronous trigger and starts its background thread.\n
+   * From now on the `write`s (and hence the `put`s and `del`s) add change log records to their batches
+   * (writes going around the wrapper, straight to `_db`, are not logged).\n
+   * A trigger resumes from its stored progress, a new trigger starts with the changes currently in the log. */
+  void putAsyncTrigger (std::shared_ptr<AsyncTrigger> trigger) {
+    ChangeLog* log = changeLog();
+    std::unique_ptr<ChangeLog::Worker> worker (new ChangeLog::Worker());
+    worker->_trigger = trigger;
+    const gstring progress (progressKey (trigger->triggerName()));
+    std::string str; leveldb::Status status (_db->Get (leveldb::ReadOptions(), leveldb::Slice (progress.data(), progress.size()), &str));
+    if (status.ok() && str.size() == 8) worker->_applied = bigEndianAt (str.data());
+    else if (!status.ok() && !status.IsNotFound()) GNTHROW (LdbEx, "Ldb.putAsyncTrigger: " + status.ToString());
+    if (trigger->wantsOldValues()) log->_oldValues = true;
+    std::lock_guard<std::mutex> lock (log->_mutex);
+    log->_enabled = true;
+    worker->_thread = std::thread (asyncTriggerLoop, _db, log, worker.get());
+    log->_workers.push_back (std::move (worker));
+  }
+
+  /** Blocks until the async triggers have applied all the changes committed before the call.
+   * Rethrows the exception if an async trigger has failed. */
+  void waitForIndexes() {
+    ChangeLog* log = _changes.get(); if (!log) return;
+    const uint64_t target = log->_lastSeq;
+    std::unique_lock<std::mutex> lock (log->_mutex);
+    log->_cond.wait (lock, [&]() {
+      for (auto& worker: log->_workers) if (worker->_error || worker->_applied < target) return worker->_error != nullptr;
+      return true;});
+    for (auto& worker: log->_workers) if (worker->_error) std::rethrow_exception (worker->_error);
+  }
+
+  /** The number of changes not yet applied by the slowest async trigger. */
+  uint64_t indexLag() {
+    ChangeLog* log = _changes.get(); if (!log) return 0;
+    std::lock_guard<std::mutex> lock (log->_mutex);
+    uint64_t lag = 0, last = log->_lastSeq;
+    for (auto& worker: log->_workers) lag = std::max (lag, last - std::min (last, worker->_applied.load()));
+    return lag;
+  }
+
+  /** Stops the async trigger threads.\n
+   * By default the writes are still logged, the triggers will catch up from their stored progress when registered again.
+   * @param keepLogging When `false` and no changes are retained (see `retainChanges`), the change log is turned off and emptied;
+   * a trigger registered later then misses the writes made in between. */
+  void stopAsyncTriggers (bool keepLogging = true) {
+    if (!_changes) return;
+    _changes->stop();
+    if (!keepLogging) stopLogging (_changes.get());
+  }
+
+ protected:
+  static gstring importKey() {gstring key (systemPrefix()); key.owned() << "imp"; return key;}
+ public:
+
+  /** Keeps the change log records after the `since` sequence number, for `exportChanges`.\n
+   * Enables the change log (if it wasn't already) for the `write`s from now on, hence should be called right after opening the database.\n
+   * Call again with the sequence the replicas have caught up with to trim the older records.
+   * @return The sequence number of the last logged change. */
+  uint64_t retainChanges (uint64_t since = 0) {
+    ChangeLog* log = changeLog();
+    {std::lock_guard<std::mutex> lock (log->_mutex); log->_retained = since; log->_enabled = true;}
+    trimChanges (_db.get(), log);
+    return log->_lastSeq;
+  }
+  /** Stops keeping the change log records for `exportChanges`; the records are still kept for the running async triggers, if any.\n
+   * With no async trigger running the change log is turned off and emptied, a trigger registered later missing the writes made in between
+   * (use `stopAsyncTriggers` instead of releasing the changes when the triggers are only paused). */
+  void releaseChanges() {
+    ChangeLog* log = _changes.get(); if (!log) return;
+    log->_retained = UINT64_MAX;
+    trimChanges (_db.get(), log);
+    stopLogging (log);
+  }
+
+  /** Writes the logged changes after the `since` sequence number into the stream as pairs of netstrings:
+   * the 8-byte big-endian sequence number and the change record (see `Change::parse`).\n
+   * Only the user keys are exported, the bookkeeping under the `systemPrefix` (such as the pending `merge` operands) is not.
+   * @param limit Maximum number of changes to export.
+   * @return The sequence number of the last exported change, `since` if there was none.
+   * @throws LdbEx if the changes after `since` were already trimmed from the log (cf. `retainChanges`). */
+  uint64_t exportChanges (uint64_t since, std::ostream& out, uint64_t limit = UINT64_MAX) {
+    ChangeLog* log = changeLog();
+    const uint64_t last = log->_lastSeq;
+    const gstring prefix (changePrefix());
+    const leveldb::Slice prefixSlice (prefix.data(), prefix.size());
+    GSTRING_ON_STACK (from, 64) << prefix; appendBigEndian (from, since + 1);
+    uint64_t seq = since, count = 0;
+    std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (leveldb::ReadOptions()));
+    for (lit->Seek (leveldb::Slice (from.data(), from.size())); lit->Valid() && count < limit; lit->Next()) {
+      const leveldb::Slice key (lit->key());
+      if (!key.starts_with (prefixSlice) || key.size() != prefix.size() + 8) break;
+      const uint64_t recSeq = bigEndianAt (key.data() + prefix.size());
+      if (recSeq != seq + 1) break;
+      GSTRING_ON_STACK (sbytes, 16); appendBigEndian (sbytes, recSeq);
+      sbytes.writeAsNetstring (out);
+      const leveldb::Slice val (lit->value());
+      gstring (0, (void*) val.data(), false, val.size()) .writeAsNetstring (out);
+      seq = recSeq; ++count;
+    }
+    if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.exportChanges: " + lit->status().ToString());
+    if (!out) GNTHROW (LdbEx, "Ldb.exportChanges: can't write to the stream");
+    if (count < limit && seq < last)
+      GNTHROW (LdbEx, "Ldb.exportChanges: change " + std::to_string (seq + 1) + " is no longer in the log (see retainChanges)");
+    return seq;
+  }
+
+  /** The sequence number of the last change applied by `importChanges`. */
+  uint64_t importedChanges() {
+    const gstring key (importKey());
+    std::string str; leveldb::Status status (_db->Get (leveldb::ReadOptions(), leveldb::Slice (key.data(), key.size()), &str));
+    if (status.ok() && str.size() == 8) return bigEndianAt (str.data());
+    if (!status.ok() && !status.IsNotFound()) GNTHROW (LdbEx, "Ldb.importedChanges: " + status.ToString());
+    return 0;
+  }
+
+  /** Applies the changes written by `exportChanges` of another database (usually the one this database is a `checkpoint` of).\n
+   * The sequence number of the last applied change is stored together with the changes (see `importedChanges`),
+   * the changes imported before are skipped, hence the same stream can be imported again after a failure.
+   * @return The number of changes applied. */
+  uint64_t importChanges (std::istream& in, uint32_t batchSize = 1024) {
+    const gstring key (importKey());
+    uint64_t imported = importedChanges(), applied = 0;
+    leveldb::WriteBatch batch; uint32_t inBatch = 0;
+    auto flush = [&]() {
+      if (!inBatch) return;
+      GSTRING_ON_STACK (pos, 16); appendBigEndian (pos, imported);
+      batch.Put (leveldb::Slice (key.data(), key.size()), leveldb::Slice (pos.data(), pos.size()));
+      write (batch);
+      batch.Clear(); inBatch = 0;
+    };
+    gstring sbytes, record; Change change;
+    while (in.peek() != std::istream::traits_type::eof()) {
+      sbytes.clear().readNetstring (in); record.clear().readNetstring (in);
+      if (sbytes.size() != 8) GNTHROW (LdbEx, "Ldb.importChanges: bad sequence number");
+      const uint64_t seq = bigEndianAt (sbytes.data());
+      if (seq <= imported) continue;
+      if (imported && seq != imported + 1) GNTHROW (LdbEx, "Ldb.importChanges: missing change " + std::to_string (imported + 1));
+      change.parse (seq, record);
+      const leveldb::Slice ckey (change._key.data(), change._key.size());
+      if (change._op == 'P') batch.Put (ckey, leveldb::Slice (change._value.data(), change._value.size()));
+      else if (change._op == 'D') batch.Delete (ckey);
+      else GNTHROW (LdbEx, "Ldb.importChanges: unknown operation");
+      imported = seq; ++applied;
+      if (++inBatch >= batchSize) flush();
+    }
+    flush();
+    return applied;
+  }
+
+ protected:
+  /** Copies the file, returning `false` if it doesn't exist. */
+  static bool copyFile (const std::string& from, const std::string& to) {
+    FILE* in = ::fopen (from.c_str(), "rb");
+    if (!in) {if (errno == ENOENT) return false; GNTHROW (LdbEx, "Ldb: can't open " + from + ": " + ::strerror (errno));}
+    std::shared_ptr<FILE> inCloser (in, ::fclose);
+    FILE* out = ::fopen (to.c_str(), "wb");
+    if (!out) GNTHROW (LdbEx, "Ldb: can't create " + to + ": " + ::strerror (errno));
+    std::shared_ptr<FILE> outCloser (out, ::fclose);
+    char buf[65536]; size_t got;
+    while ((got = ::fread (buf, 1, sizeof (buf), in)) > 0)
+      if (::fwrite (buf, 1, got, out) != got) GNTHROW (LdbEx, "Ldb: can't write " + to + ": " + ::strerror (errno));
+    if (::ferror (in)) GNTHROW (LdbEx, "Ldb: can't read " + from);
+    if (::fflush (out) || ::fsync (::fileno (out))) GNTHROW (LdbEx, "Ldb: can't flush " + to + ": " + ::strerror (errno));
+    return true;
+  }
+  /** Reads a small file (like the CURRENT), returning an empty string if the file doesn't exist. */
+  static std::string readFile (const std::string& path) {
+    std::string content; FILE* file = ::fopen (path.c_str(), "rb");
+    if (!file) {if (errno == ENOENT) return content; GNTHROW (LdbEx, "Ldb: can't open " + path + ": " + ::strerror (errno));}
+    char buf[4096]; size_t got;
+    while ((got = ::fread (buf, 1, sizeof (buf), file)) > 0) content.append (buf, got);
+    ::fclose (file);
+    return content;
+  }
+  static int64_t fileSize (const std::string& path) {
+    struct stat st; return ::stat (path.c_str(), &st) ? -1 : (int64_t) st.st_size;
+  }
+  static std::vector<std::string> listDir (const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = ::opendir (path.c_str());
+    if (!dir) GNTHROW (LdbEx, "Ldb: can't open the directory " + path + ": " + ::strerror (errno));
+    while (struct dirent* entry = ::readdir (dir)) {
+      std::string name (entry->d_name);
+      if (name != "." && name != "..") names.push_back (name);
+    }
+    ::closedir (dir);
+    return names;
+  }
+  static bool endsWith (const std::string& name, const char* suffix) {
+    const size_t len = ::strlen (suffix);
+    return name.size() >= len && name.compare (name.size() - len, len, suffix) == 0;
+  }
+ public:
+
+  /** Makes a consistent copy of the database in the `dir` without stopping the writers.\n
+   * The immutable table files are hard-linked (copied if the `dir` is on a different file system),
+   * the MANIFEST and the logs are copied and the CURRENT is written last.
+   * If the database version changes during the copying (a compaction, a new log) then the copying is retried.\n
+   * The copy can be opened as a separate database and brought up to date with `importChanges`
+   * from the `exportChanges (returnedSequence, ...)` of this database (see `retainChanges`).
+   * @param dir A new or empty directory.
+   * @return The last change log sequence number at the start of the checkpoint: the copy has all the changes up to it. */
+  uint64_t checkpoint (const std::string& dir, uint32_t attempts = 16, mode_t mode = 0770) {
+    if (_path.empty()) GNTHROW (LdbEx, "Ldb.checkpoint: the database directory is unknown");
+    mkdir (dir.c_str(), mode);
+    if (!listDir (dir) .empty()) GNTHROW (LdbEx, "Ldb.checkpoint: " + dir + " is not empty");
+    const uint64_t seq = _changes ? _changes->_lastSeq.load() : 0;
+    for (uint32_t attempt = 0; attempt < attempts; ++attempt) {
+      for (const std::string& name: listDir (dir)) ::unlink ((dir + '/' + name) .c_str()); // Leftovers of the previous attempt.
+      const std::string current (readFile (_path + "/CURRENT"));
+      const std::string manifest (current.substr (0, current.find ('\n')));
+      if (manifest.empty()) GNTHROW (LdbEx, "Ldb.checkpoint: no CURRENT in " + _path);
+      const int64_t manifestSize = fileSize (_path + '/' + manifest);
+      bool complete = manifestSize >= 0 && copyFile (_path + '/' + manifest, dir + '/' + manifest);
+      for (const std::string& name: listDir (_path)) {
+        if (!complete) break;
+        const std::string from (_path + '/' + name), to (dir + '/' + name);
+        if (endsWith (name, ".ldb") || endsWith (name, ".sst")) {
+          if (::link (from.c_str(), to.c_str()) == 0) continue;
+          if (errno == ENOENT) complete = false;
+          else if (errno == EXDEV || errno == EPERM) complete = copyFile (from, to);
+          else GNTHROW (LdbEx, "Ldb.checkpoint: can't link " + from + ": " + ::strerror (errno));
+        } else if (endsWith (name, ".log")) complete = copyFile (from, to);
+      }
+      // An unchanged MANIFEST means that no table files or logs were added or removed while we were copying.
+      if (!complete || readFile (_path + "/CURRENT") != current || fileSize (_path + '/' + manifest) != manifestSize) continue;
+      const std::string tmp (dir + "/CURRENT.tmp");
+      FILE* file = ::fopen (tmp.c_str(), "wb");
+      if (!file) GNTHROW (LdbEx, "Ldb.checkpoint: can't create " + tmp + ": " + ::strerror (errno));
+      const bool written = ::fwrite (current.data(), 1, current.size(), file) == current.size() && !::fflush (file) && !::fsync (::fileno (file));
+      ::fclose (file);
+      if (!written || ::rename (tmp.c_str(), (dir + "/CURRENT") .c_str()))
+        GNTHROW (LdbEx, "Ldb.checkpoint: can't write " + dir + "/CURRENT: " + ::strerror (errno));
+      return seq;
+    }
+    GNTHROW (LdbEx, "Ldb.checkpoint: the database kept changing, gave up after " + std::to_string (attempts) + " attempts");
+  }
+
  public:
 
   Ldb() {}
 
-  /** Opens Leveldb database. */
+  /** Opens Leveldb database.
+   * @param options If `nullptr` then the database is opened with the default `Ldb::Options`. */
   Ldb (const char* path, leveldb::Options* options = nullptr, mode_t mode = 0770) {
+    if (!options) {open (path, Options(), mode); return;}
+    mkdir (path, mode);
+    leveldb::DB* db;
+    leveldb::Status status = leveldb::DB::Open (*options, path, &db);
+    if (!status.ok()) GNTHROW (LdbEx, std::string ("Ldb: Can't open ") + path + ": " + status.ToString());
+    _db.reset (db); _path = path;
+  }
+
+  /** Opens Leveldb database, creating it if necessary, with the given cache, buffer and filter settings. */
+  Ldb (const char* path, const Options& options, mode_t mode = 0770) {
+    open (path, options, mode);
+  }
+
+ protected:
+  static void mkdir (const char* path, mode_t mode) {
     int rc = ::mkdir (path, mode);
     if (rc && errno != EEXIST) GNTHROW (LdbEx, std::string ("Can't create ") + path + ": " + ::strerror (errno));
-    leveldb::DB* db;
-    leveldb::Status status;
-    if (options) {
-      status = leveldb::DB::Open (*options, path, &db);
-    } else {
-      leveldb::Options localOptions;
-      localOptions.create_if_missing = true;
-      _filter.reset (leveldb::NewBloomFilterPolicy (8));
+  }
+  void open (const char* path, const Options& options, mode_t mode) {
+    mkdir (path, mode);
+    leveldb::Options localOptions;
+    localOptions.create_if_missing = true;
+    localOptions.paranoid_checks = options._paranoidChecks;
+    localOptions.write_buffer_size = options._writeBufferBytes;
+    localOptions.max_open_files = options._maxOpenFiles;
+    localOptions.block_size = options._blockSize;
+    localOptions.max_file_size = options._maxFileSize;
+    localOptions.compression = options._compression;
+    _cache = std::make_shared<CountingCache> (options._cacheBytes);
+    localOptions.block_cache = _cache.get();
+    if (options._bloomBits > 0) {
+      _filter.reset (leveldb::NewBloomFilterPolicy (options._bloomBits));
       localOptions.filter_policy = _filter.get();
-      status = leveldb::DB::Open (localOptions, path, &db);
     }
+    leveldb::DB* db;
+    leveldb::Status status = leveldb::DB::Open (localOptions, path, &db);
     if (!status.ok()) GNTHROW (LdbEx, std::string ("Ldb: Can't open ") + path + ": " + status.ToString());
-    _db.reset (db);
+    // The cache and the filter must outlive the database, even if the `_db` is shared beyond the Ldb.
+    std::shared_ptr<CountingCache> cache (_cache); std::shared_ptr<const leveldb::FilterPolicy> filter (_filter);
+    _db.reset (db, [cache,filter] (leveldb::DB* db) {delete db;});
+    _path = path;
+  }
+ public:
+
+  /** Returns the value of a Leveldb property, such as "leveldb.stats" or "leveldb.sstables", or an empty string if the property is unknown. */
+  std::string property (const char* name) {
+    std::string value;
+    if (!_db->GetProperty (leveldb::Slice (name), &value)) value.clear();
+    return value;
+  }
+
+  /** Database statistics, see `stats`. */
+  struct Stats {
+    uint64_t _cacheHits = 0, _cacheMisses = 0; ///< Block cache lookups (only counted if the database was opened with `Ldb::Options`).
+    size_t _cacheUsage = 0, _cacheCapacity = 0; ///< Block cache charge in bytes.
+    uint64_t _memoryUsage = 0; ///< "leveldb.approximate-memory-usage" (memtables and caches).
+    std::vector<int> _filesAtLevel; ///< Number of table files at every level.
+    std::string _compactions; ///< "leveldb.stats": the per-level compaction table.
+    double cacheHitRate() const {uint64_t lookups = _cacheHits + _cacheMisses; return lookups ? (double) _cacheHits / lookups : 0.0;}
+  };
+  Stats stats() {
+    Stats stats;
+    if (_cache) {
+      stats._cacheHits = _cache->_hits; stats._cacheMisses = _cache->_misses;
+      stats._cacheUsage = _cache->TotalCharge(); stats._cacheCapacity = _cache->_capacity;
+    }
+    std::string value;
+    if (_db->GetProperty ("leveldb.approximate-memory-usage", &value)) stats._memoryUsage = ::strtoull (value.c_str(), nullptr, 10);
+    for (int level = 0; level < 16; ++level) {
+      char name[48]; ::snprintf (name, sizeof (name), "leveldb.num-files-at-level%d", level);
+      if (!_db->GetProperty (name, &value)) break; // Past the last level.
+      stats._filesAtLevel.push_back (::atoi (value.c_str()));
+    }
+    _db->GetProperty ("leveldb.stats", &stats._compactions);
+    return stats;
   }
 
-  /** Wraps an existing Leveldb handler. */
+  /** Wraps an existing Leveldb handler.\n
+   * The change log, expiry and merging state is shared with the copies of this Ldb, not with the other wrappers of the same handler. */
   Ldb (std::shared_ptr<leveldb::DB> db): _db (db) {}
 
   template <typename K, typename V> void put (const K& key, const V& value, leveldb::WriteBatch& batch) {
@@ -313,8 +1068,7 @@ struct Ldb {
   template <typename K, typename V> void put (const K& key, const V& value) {
     leveldb::WriteBatch batch;
     put (key, value, batch);
-    leveldb::Status status (_db->Write (leveldb::WriteOptions(), &batch));
-    if (!status.ok()) GNTHROW (LdbEx, "Ldb: add: " + status.ToString());
+    write (batch);
   }
 
   /** Returns `true` if the key exists. Throws on error. */
@@ -351,6 +1105,76 @@ struct Ldb {
     else GTHROW ("Ldb.get: " + status.ToString());
   }
 
+  /** Looks up a number of keys against a single snapshot (`options.snapshot` or a fresh one).\n
+   * The serialized keys are sorted and then resolved either with a single forward-moving iterator (when the keys are dense)
+   * or with the point `Get`s (which can use the Bloom filter), reusing the same buffer for all of them.\n
+   * `values` and `found` are resized to `keys.size()`; `values[n]` is only modified if `found[n]` is `true`
+   * (deserializing into the existing `values` allows them to reuse their buffers between the calls).
+   * @param denseBytes Use the iterator if the approximate size of the data between the first and the last key, divided by the number of keys, is at most that.
+   * @return The number of keys found. */
+  template <typename K, typename V>
+  size_t getMulti (const std::vector<K>& keys, std::vector<V>& values, std::vector<bool>& found,
+                   leveldb::ReadOptions options = leveldb::ReadOptions(), uint32_t denseBytes = 4096) {
+    const size_t count = keys.size();
+    values.resize (count); found.assign (count, false);
+    if (count == 0) return 0;
+
+    // Serialize all the keys into a single buffer.
+    GSTRING_ON_STACK (kbytes, 1024);
+    std::vector<uint32_t> offsets; offsets.reserve (count + 1);
+    for (const K& key: keys) {
+      offsets.push_back (kbytes.size());
+      char kbuf[64]; gstring kb (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kb, key);
+      kbytes << kb;
+    }
+    offsets.push_back (kbytes.size());
+    auto keyAt = [&] (uint32_t num) {return leveldb::Slice (kbytes.data() + offsets[num], offsets[num + 1] - offsets[num]);};
+    std::vector<uint32_t> order (count); for (uint32_t num = 0; num < count; ++num) order[num] = num;
+    std::sort (order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {return keyAt (a) .compare (keyAt (b)) < 0;});
+
+    std::shared_ptr<const leveldb::Snapshot> snapshot;
+    if (!options.snapshot) {snapshot = this->snapshot(); options.snapshot = snapshot.get();}
+
+    bool dense = false;
+    if (count > 1) {
+      const leveldb::Slice first (keyAt (order.front())), last (keyAt (order.back()));
+      std::string limit (last.data(), last.size()); limit.push_back (0); // Just past the last key.
+      leveldb::Range range (first, leveldb::Slice (limit)); uint64_t size = 0;
+      _db->GetApproximateSizes (&range, 1, &size);
+      dense = size / count <= denseBytes;
+    }
+
+    size_t have = 0;
+    if (dense) {
+      std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (options));
+      bool positioned = false;
+      for (uint32_t num: order) {
+        const leveldb::Slice key (keyAt (num));
+        if (!positioned) {lit->Seek (key); positioned = true;}
+        else { // Nearby keys are cheaper to reach with `Next` than with `Seek`.
+          for (int step = 0; step < 4 && lit->Valid() && lit->key().compare (key) < 0; ++step) lit->Next();
+          if (lit->Valid() && lit->key().compare (key) < 0) lit->Seek (key);
+        }
+        if (!lit->Valid()) break;
+        if (lit->key() != key) continue;
+        const leveldb::Slice val (lit->value());
+        ldbDeserialize (gstring (0, (void*) val.data(), false, val.size()), values[num]);
+        found[num] = true; ++have;
+      }
+      if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.getMulti: " + lit->status().ToString());
+    } else {
+      std::string str;
+      for (uint32_t num: order) {
+        leveldb::Status status (_db->Get (options, keyAt (num), &str));
+        if (status.ok()) {
+          ldbDeserialize (gstring (0, (void*) str.data(), false, str.size()), values[num]);
+          found[num] = true; ++have;
+        } else if (!status.IsNotFound()) GNTHROW (LdbEx, "Ldb.getMulti: " + status.ToString());
+      }
+    }
+    return have;
+  }
+
   template <typename K> void del (const K& key, leveldb::WriteBatch& batch) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
@@ -364,17 +1188,439 @@ struct Ldb {
   template <typename K> void del (const K& key) {
     leveldb::WriteBatch batch;
     del (key, batch);
-    leveldb::Status status (_db->Write (leveldb::WriteOptions(), &batch));
-    if (!status.ok()) GNTHROW (LdbEx, "Ldb: del: " + status.ToString());
+    write (batch);
+  }
+
+ protected:
+  /** A copy for the background threads (`Periodic`): shares the change log, expiry and merging state without keeping it alive.
+   * The state joins its threads when the last owning copy of the Ldb is gone; a thread owning the state would never let that happen. */
+  Ldb backgroundCopy() {
+    Ldb ldb (*this);
+    ldb._changes = std::shared_ptr<ChangeLog> (std::shared_ptr<ChangeLog>(), _changes.get());
+    ldb._expiry = std::shared_ptr<Expiry> (std::shared_ptr<Expiry>(), _expiry.get());
+    ldb._merging = std::shared_ptr<Merging> (std::shared_ptr<Merging>(), _merging.get());
+    return ldb;
+  }
+ public:
+
+  /** Background thread invoking a function every `intervalSec` seconds, until stopped.
+   * The exceptions of the function are kept for the owner to pick up with `takeError`. */
+  struct Periodic {
+    std::mutex _mutex; std::condition_variable _cond; bool _stop = false;
+    std::exception_ptr _error; ///< The last failure of the function, if not yet taken.
+    std::thread _thread;
+    bool running() const {return _thread.joinable();}
+    void start (uint32_t intervalSec, std::function<void()> fun) {
+      _thread = std::thread ([this,intervalSec,fun]() {
+        std::unique_lock<std::mutex> lock (_mutex);
+        while (!_cond.wait_for (lock, std::chrono::seconds (intervalSec), [this]() {return _stop;})) {
+          lock.unlock();
+          std::exception_ptr error; try {fun();} catch (...) {error = std::current_exception();}
+          lock.lock();
+          if (error) _error = error;
+        }
+      });
+    }
+    /** Returns and clears the last failure of the function (`nullptr` if there was none). */
+    std::exception_ptr takeError() {
+      std::lock_guard<std::mutex> lock (_mutex);
+      std::exception_ptr error; std::swap (error, _error); return error;
+    }
+    void stop() {
+      {std::lock_guard<std::mutex> lock (_mutex); _stop = true;}
+      _cond.notify_all();
+      if (_thread.joinable()) _thread.join();
+      std::lock_guard<std::mutex> lock (_mutex); _stop = false;
+    }
+    ~Periodic() {stop();}
+  };
+
+  /** State of the expiring keys, shared between the copies of an Ldb. */
+  struct Expiry {
+    std::atomic<uint64_t> _keys {0}, _bytes {0}; ///< Purged so far: the number of keys and their key plus value bytes.
+    std::mutex _stripes[64]; ///< Per-key locks serializing `putExpiring` with the checks and deletes of `purgeExpired`.
+    Periodic _sweeper;
+    size_t stripeOf (const gstring& kbytes) {return std::hash<gstring>() (kbytes) % 64;}
+  };
+  std::shared_ptr<Expiry> _expiry = std::make_shared<Expiry>();
+
+ protected:
+  Expiry* expiry() {return _expiry.get();}
+  static gstring expiryPrefix() {gstring prefix (systemPrefix()); prefix.owned() << "ttl"; return prefix;}
+ public:
+
+  /** Puts a value which expires `ttlSec` seconds from now.\n
+   * The value is stored with its expiration time (8 bytes, big-endian seconds since the epoch) in front of it,
+   * and the key is added to a time-ordered index under the `systemPrefix` which `purgeExpired` uses to delete the key.\n
+   * Such values should be read with `getLive` (or checked with `liveValue` when iterating)
+   * and the key should not be rewritten with a plain `put`.\n
+   * Triggers get the value bytes without the expiration time.\n
+   * NB: This form is not serialized with `purgeExpired`: a key rewritten with it as its old value expires might be purged.
+   * The form without the `batch` is safe in this regard. */
+  template <typename K, typename V> void putExpiring (const K& key, const V& value, uint32_t ttlSec, leveldb::WriteBatch& batch) {
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    char vbuf[64]; gstring vbytes (sizeof (vbuf), vbuf, false, 0); ldbSerialize (vbytes, value);
+    const uint64_t expires = (uint64_t) ::time (nullptr) + ttlSec;
+
+    for (auto& trigger: _triggers) trigger.second->put (*this, (void*) &key, kbytes, (void*) &value, vbytes, batch);
+
+    GSTRING_ON_STACK (stored, 128); appendBigEndian (stored, expires); stored << vbytes;
+    batch.Put (leveldb::Slice (kbytes.data(), kbytes.size()), leveldb::Slice (stored.data(), stored.size()));
+    GSTRING_ON_STACK (ikey, 128) << expiryPrefix(); appendBigEndian (ikey, expires); ikey << kbytes;
+    batch.Put (leveldb::Slice (ikey.data(), ikey.size()), leveldb::Slice());
+  }
+  template <typename K, typename V> void putExpiring (const K& key, const V& value, uint32_t ttlSec) {
+    Expiry* exp = expiry();
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    std::lock_guard<std::mutex> lock (exp->_stripes[exp->stripeOf (kbytes)]);
+    leveldb::WriteBatch batch;
+    putExpiring (key, value, ttlSec, batch);
+    write (batch);
+  }
+
+  /** Checks the expiration time of a value written with `putExpiring`.
+   * @param vbytes The stored value bytes; if the value is live then `vbytes` is changed to point at the value without the expiration time.
+   * @return `false` if the value has expired (or is too short to have an expiration time). */
+  static bool liveValue (gstring& vbytes, time_t now) {
+    if (vbytes.size() < 8 || bigEndianAt (vbytes.data()) <= (uint64_t) now) return false;
+    vbytes = vbytes.view (8);
+    return true;
+  }
+
+  /** Returns `true` and modifies `value` if `key` is found and has not expired yet. See `putExpiring`. */
+  template <typename K, typename V> bool getLive (const K& key, V& value, leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    std::string str;
+    leveldb::Status status (_db->Get (options, leveldb::Slice (kbytes.data(), kbytes.size()), &str));
+    if (status.IsNotFound()) return false;
+    if (!status.ok()) GNTHROW (LdbEx, "Ldb.getLive: " + status.ToString());
+    gstring vbytes (0, (void*) str.data(), false, str.size());
+    if (!liveValue (vbytes, ::time (nullptr))) return false;
+    ldbDeserialize (vbytes, value);
+    return true;
+  }
+
+  /** Deletes the keys which have expired by `now`, walking the expiration index (the rest of the database is not touched).\n
+   * Index entries left behind by the keys rewritten with a new TTL or deleted are removed as well.\n
+   * The deletes go through `write` (and so into the change log, if any) but the `Trigger`s are not invoked.\n
+   * The index entries are processed in chunks, the check and the delete of a chunk's keys holding their `putExpiring` stripes.
+   * @param limit Maximum number of index entries to process.
+   * @return The number of keys deleted. */
+  uint64_t purgeExpired (time_t now = ::time (nullptr), uint32_t limit = UINT32_MAX) {
+    Expiry* exp = expiry();
+    const gstring prefix (expiryPrefix());
+    uint64_t purged = 0, purgedBytes = 0; uint32_t processed = 0;
+    std::vector<std::string> ikeys; std::string str;
+    auto purgeChunk = [&]() {
+      bool stripes[64] = {};
+      for (auto& ikey: ikeys) stripes[exp->stripeOf (gstring (0, (void*) (ikey.data() + prefix.size() + 8), false, ikey.size() - prefix.size() - 8))] = true;
+      std::vector<std::unique_lock<std::mutex>> locks; // Taken in the stripe order, hence no deadlocks between the chunks.
+      for (int st = 0; st < 64; ++st) if (stripes[st]) locks.emplace_back (exp->_stripes[st]);
+      leveldb::WriteBatch batch;
+      for (auto& ikey: ikeys) {
+        const uint64_t expires = bigEndianAt (ikey.data() + prefix.size());
+        const leveldb::Slice key (ikey.data() + prefix.size() + 8, ikey.size() - prefix.size() - 8);
+        leveldb::Status status (_db->Get (leveldb::ReadOptions(), key, &str));
+        if (status.ok() && str.size() >= 8 && bigEndianAt (str.data()) == expires) {
+          batch.Delete (key); ++purged; purgedBytes += key.size() + str.size();
+        } else if (!status.ok() && !status.IsNotFound()) GNTHROW (LdbEx, "Ldb.purgeExpired: " + status.ToString());
+        batch.Delete (leveldb::Slice (ikey));
+      }
+      write (batch);
+      ikeys.clear();
+    };
+    std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (leveldb::ReadOptions()));
+    for (lit->Seek (leveldb::Slice (prefix.data(), prefix.size())); lit->Valid() && processed < limit; lit->Next()) {
+      const leveldb::Slice ikey (lit->key());
+      if (!ikey.starts_with (leveldb::Slice (prefix.data(), prefix.size())) || ikey.size() < prefix.size() + 8) break;
+      if (bigEndianAt (ikey.data() + prefix.size()) > (uint64_t) now) break; // The index is ordered by time.
+      ikeys.emplace_back (ikey.data(), ikey.size()); ++processed;
+      if (ikeys.size() == 1024) purgeChunk();
+    }
+    if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.purgeExpired: " + lit->status().ToString());
+    lit.reset();
+    if (!ikeys.empty()) purgeChunk();
+    exp->_keys += purged; exp->_bytes += purgedBytes;
+    return purged;
+  }
+
+  /** Runs `purgeExpired` every `intervalSec` seconds on a background thread, until `stopExpirySweeper` or the last copy of the Ldb is gone.
+   * Leveldb has no compaction filters, hence the sweeper. Its failures are kept for `expirySweeperError`. */
+  void startExpirySweeper (uint32_t intervalSec = 60) {
+    Expiry* exp = expiry();
+    if (exp->_sweeper.running()) return;
+    Ldb ldb (backgroundCopy());
+    exp->_sweeper.start (intervalSec, [ldb]() mutable {ldb.purgeExpired();});
+  }
+  void stopExpirySweeper() {if (_expiry) _expiry->_sweeper.stop();}
+  /** Returns and clears the last failure of the expiry sweeper, `nullptr` if there was none (cf. `std::rethrow_exception`). */
+  std::exception_ptr expirySweeperError() {return _expiry ? _expiry->_sweeper.takeError() : nullptr;}
+
+  /** The number of expired keys purged so far. */
+  uint64_t expiredKeys() const {return _expiry ? _expiry->_keys.load() : 0;}
+  /** The number of key and value bytes freed by purging the expired keys. */
+  uint64_t expiredBytes() const {return _expiry ? _expiry->_bytes.load() : 0;}
+
+  /** Associative merge of the serialized values, see `merge`. */
+  struct Merger {
+    /** Folds the `operand` into the `value`.
+     * @param exists Whether there was a value before (otherwise the `value` is empty). */
+    virtual void merge (const gstring& kbytes, gstring& value, bool exists, const gstring& operand) = 0;
+    virtual ~Merger() {}
+  };
+  /** `Merger` deserializing the value into `V` and the operand into `O` and invoking `fun (V& value, const O& operand)`. */
+  template <typename V, typename O, typename Fun> struct FunMerger: public Merger {
+    Fun _fun;
+    FunMerger (Fun fun): _fun (fun) {}
+    virtual void merge (const gstring& kbytes, gstring& value, bool exists, const gstring& operand) override {
+      V val; if (exists) ldbDeserialize (value, val);
+      O op; ldbDeserialize (operand, op);
+      _fun (val, op);
+      GSTRING_ON_STACK (bytes, 128); ldbSerialize (bytes, val);
+      gstring copy (bytes.clone()); // NB: `bytes` might be a view into the `value`.
+      value.clear() << copy;
+    }
+  };
+  /** Example: \code ldb.setMerger (Ldb::makeMerger<int64_t, int64_t> ([](int64_t& counter, int64_t inc) {counter += inc;})); \endcode */
+  template <typename V, typename O, typename Fun> static std::shared_ptr<Merger> makeMerger (Fun fun) {
+    return std::make_shared<FunMerger<V, O, Fun>> (fun);
+  }
+
+  /** State of the `merge` and `update` operations, shared between the copies of an Ldb. */
+  struct Merging {
+    std::shared_ptr<Merger> _merger;
+    std::once_flag _restored; ///< `_seq` is restored from the reserved block in the database on the first `merge`.
+    std::atomic<uint64_t> _seq {0}; ///< The last operand sequence number handed out.
+    std::mutex _reserveMutex; std::atomic<uint64_t> _reserved {0}; ///< The operand sequence numbers up to `_reserved` are recorded in the database.
+    std::mutex _stripes[64]; ///< Per-key locks for `update` and the consolidation.
+    Periodic _consolidator;
+    std::mutex& stripe (const gstring& kbytes) {return _stripes[std::hash<gstring>() (kbytes) % 64];}
+  };
+  std::shared_ptr<Merging> _merging = std::make_shared<Merging>();
+
+ protected:
+  Merging* merging() {return _merging.get();}
+  static gstring mergePrefix() {gstring prefix (systemPrefix()); prefix.owned() << "mrg"; return prefix;}
+  static gstring operandSeqKey() {gstring key (systemPrefix()); key.owned() << "msq"; return key;}
+  /** The next `merge` operand sequence number.\n
+   * The numbers are reserved in the database in blocks, ahead of the operands using them,
+   * so that the operands written after a restart sort after the older operands of the key. */
+  uint64_t nextOperandSeq (Merging* mg) {
+    const gstring seqKey (operandSeqKey());
+    std::call_once (mg->_restored, [&]() {
+      std::string str; leveldb::Status status (_db->Get (leveldb::ReadOptions(), leveldb::Slice (seqKey.data(), seqKey.size()), &str));
+      uint64_t seq;
+      if (status.ok() && str.size() == 8) seq = bigEndianAt (str.data());
+      else if (status.ok() || status.IsNotFound()) { // Operands written before the sequence was kept are numbered with the realtime nanoseconds.
+        timespec ts; ::clock_gettime (CLOCK_REALTIME, &ts); seq = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+      } else GNTHROW (LdbEx, "Ldb.merge: " + status.ToString());
+      mg->_seq = seq; mg->_reserved = seq;
+    });
+    const uint64_t seq = ++mg->_seq;
+    if (seq > mg->_reserved) {
+      std::lock_guard<std::mutex> lock (mg->_reserveMutex);
+      while (seq > mg->_reserved) {
+        const uint64_t reserved = mg->_reserved + 65536;
+        GSTRING_ON_STACK (rbytes, 16); appendBigEndian (rbytes, reserved);
+        leveldb::Status status (_db->Put (leveldb::WriteOptions(), leveldb::Slice (seqKey.data(), seqKey.size()), leveldb::Slice (rbytes.data(), rbytes.size())));
+        if (!status.ok()) GNTHROW (LdbEx, "Ldb.merge: " + status.ToString());
+        mg->_reserved = reserved;
+      }
+    }
+    return seq;
+  }
+  /** Operands of a key are stored under the `mergePrefix`, the key length and the key, followed by the operand's sequence number.
+   * @param operands The key followed by the operand sequence number. */
+  static void operandsPrefix (gstring& operands, const gstring& kbytes) {
+    operands << mergePrefix();
+    char len[4]; uint32_t klen = htonl (kbytes.size()); memcpy (len, &klen, 4); operands.append (len, 4);
+    operands << kbytes;
+  }
+  /** Reads the base value and folds the pending operands of the key, adding the deletion of the operands to the `batch`.
+   * @return `false` if there is neither a base value nor operands. */
+  bool foldOperands (const gstring& kbytes, gstring& value, leveldb::ReadOptions options, leveldb::WriteBatch* batch) {
+    std::string str;
+    leveldb::Status status (_db->Get (options, leveldb::Slice (kbytes.data(), kbytes.size()), &str));
+    bool exists = status.ok();
+    if (!exists && !status.IsNotFound()) GNTHROW (LdbEx, "Ldb.merge: " + status.ToString());
+    value.clear(); if (exists) value.append (str.data(), str.size());
+    Merger* merger = _merging ? _merging->_merger.get() : nullptr;
+    GSTRING_ON_STACK (prefix, 128); operandsPrefix (prefix, kbytes);
+    const leveldb::Slice prefixSlice (prefix.data(), prefix.size());
+    std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (options));
+    for (lit->Seek (prefixSlice); lit->Valid() && lit->key().starts_with (prefixSlice) && lit->key().size() == prefix.size() + 8; lit->Next()) {
+      if (!merger) GNTHROW (LdbEx, "Ldb.merge: pending operands but no Merger (see setMerger)");
+      const leveldb::Slice op (lit->value());
+      merger->merge (kbytes, value, exists, gstring (0, (void*) op.data(), false, op.size()));
+      exists = true;
+      if (batch) batch->Delete (lit->key());
+    }
+    if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.merge: " + lit->status().ToString());
+    return exists;
+  }
+ public:
+
+  /** Sets the `Merger` used by `getMerged` and `consolidate`. */
+  void setMerger (std::shared_ptr<Merger> merger) {merging()->_merger = merger;}
+
+  /** Records the `operand` to be merged into the `key`'s value later, without reading the value.\n
+   * The operands are folded into the value on `getMerged` (without writing it back) and by `consolidate`.\n
+   * The keys used with `merge` should be read with `getMerged` and should not be written with `put`
+   * (the pending operands would be applied on top of the new value).\n
+   * The operands of a key are folded in the order of the `merge`s, kept across restarts with a sequence persisted under the `systemPrefix`.
+   * Triggers are not invoked. */
+  template <typename K, typename O> void merge (const K& key, const O& operand, leveldb::WriteBatch& batch) {
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    char obuf[64]; gstring obytes (sizeof (obuf), obuf, false, 0); ldbSerialize (obytes, operand);
+    const uint64_t seq = nextOperandSeq (merging());
+    GSTRING_ON_STACK (okey, 128); operandsPrefix (okey, kbytes); appendBigEndian (okey, seq);
+    batch.Put (leveldb::Slice (okey.data(), okey.size()), leveldb::Slice (obytes.data(), obytes.size()));
+  }
+  template <typename K, typename O> void merge (const K& key, const O& operand) {
+    leveldb::WriteBatch batch;
+    merge (key, operand, batch);
+    write (batch);
+  }
+
+  /** Returns `true` and modifies `value` if the `key` has a value or pending `merge` operands. */
+  template <typename K, typename V> bool getMerged (const K& key, V& value, leveldb::ReadOptions options = leveldb::ReadOptions()) {
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    std::shared_ptr<const leveldb::Snapshot> snapshot;
+    if (!options.snapshot) {snapshot = this->snapshot(); options.snapshot = snapshot.get();}
+    GSTRING_ON_STACK (vbytes, 128);
+    if (!foldOperands (kbytes, vbytes, options, nullptr)) return false;
+    ldbDeserialize (vbytes, value);
+    return true;
+  }
+
+  /** Folds the pending `merge` operands into the values, writing the values back and deleting the operands.
+   * @param limit Maximum number of keys to consolidate.
+   * @return The number of keys consolidated. */
+  uint64_t consolidate (uint32_t limit = UINT32_MAX) {
+    Merging* mg = merging();
+    const gstring prefix (mergePrefix());
+    const leveldb::Slice prefixSlice (prefix.data(), prefix.size());
+    uint64_t keys = 0; gstring kbytes, vbytes, last;
+    std::unique_ptr<leveldb::Iterator> lit (_db->NewIterator (leveldb::ReadOptions()));
+    for (lit->Seek (prefixSlice); lit->Valid() && lit->key().starts_with (prefixSlice) && keys < limit; lit->Next()) {
+      const leveldb::Slice okey (lit->key());
+      if (okey.size() < prefix.size() + 4 + 8) continue;
+      uint32_t klen; memcpy (&klen, okey.data() + prefix.size(), 4); klen = ntohl (klen);
+      if (okey.size() != prefix.size() + 4 + klen + 8) continue;
+      const gstring kview (0, (void*) (okey.data() + prefix.size() + 4), false, klen);
+      if (kview == last) continue; // Already consolidated.
+      last.clear() << kview;
+      kbytes.clear() << kview;
+      std::lock_guard<std::mutex> lock (mg->stripe (kbytes));
+      leveldb::WriteBatch batch;
+      if (foldOperands (kbytes, vbytes, leveldb::ReadOptions(), &batch)) {
+        batch.Put (leveldb::Slice (kbytes.data(), kbytes.size()), leveldb::Slice (vbytes.data(), vbytes.size()));
+        write (batch); ++keys;
+      }
+    }
+    if (!lit->status().ok()) GNTHROW (LdbEx, "Ldb.consolidate: " + lit->status().ToString());
+    return keys;
+  }
+
+  /** Runs `consolidate` every `intervalSec` seconds on a background thread, until `stopConsolidation` or the last copy of the Ldb is gone.
+   * Its failures are kept for `consolidationError`. */
+  void startConsolidation (uint32_t intervalSec = 60) {
+    Merging* mg = merging();
+    if (mg->_consolidator.running()) return;
+    Ldb ldb (backgroundCopy());
+    mg->_consolidator.start (intervalSec, [ldb]() mutable {ldb.consolidate();});
+  }
+  void stopConsolidation() {if (_merging) _merging->_consolidator.stop();}
+  /** Returns and clears the last failure of the background consolidation, `nullptr` if there was none (cf. `std::rethrow_exception`). */
+  std::exception_ptr consolidationError() {return _merging ? _merging->_consolidator.takeError() : nullptr;}
+
+  /** Atomic read-modify-write of the `key` for the non-associative changes.\n
+   * `fun (V& value, bool exists)` gets the current value (with any pending `merge` operands folded in) and returns `true` to write it back.\n
+   * The `update`s of the same key (and the `consolidate`) are serialized with a striped lock;
+   * plain `put`s of the key are not and should be avoided.
+   * @return Whatever the `fun` returned. */
+  template <typename K, typename V, typename Fun> bool update (const K& key, Fun fun) {
+    char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+    std::lock_guard<std::mutex> lock (merging()->stripe (kbytes));
+    leveldb::WriteBatch batch;
+    GSTRING_ON_STACK (vbytes, 128);
+    const bool exists = foldOperands (kbytes, vbytes, leveldb::ReadOptions(), &batch);
+    V value; if (exists) ldbDeserialize (vbytes, value);
+    if (!fun (value, exists)) return false;
+    put (key, value, batch);
+    write (batch);
+    return true;
+  }
+
+  /** Initial load of a large number of records.\n
+   * The records are sorted externally, with bounded memory (cf. `ExternalSort`), and then written in large sorted batches without `sync`,
+   * so that Leveldb gets non-overlapping tables instead of rewriting the same key ranges over and over in compactions.\n
+   * When the same key is `put` several times the last value wins, as with `Ldb::put`.\n
+   * NB: Triggers are not invoked for the loaded records.\n
+   * Example: \code
+   *   auto loader = ldb.bulkLoader();
+   *   for (auto& row: rows) loader.put (row.id, row);
+   *   loader.finish();
+   * \endcode */
+  struct BulkLoader {
+    Ldb* _ldb;
+    ExternalSort _sort;
+    uint32_t _batchBytes;
+    /// Invoked after every batch is written with the number of records and bytes written so far.
+    std::function<void(uint64_t records, uint64_t bytes)> _progress;
+
+    BulkLoader (Ldb* ldb, size_t memoryLimit, uint32_t batchBytes, std::string tmpDir):
+      _ldb (ldb), _sort (memoryLimit, tmpDir), _batchBytes (batchBytes) {}
+
+    template <typename K, typename V> void put (const K& key, const V& value) {
+      char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); ldbSerialize (kbytes, key);
+      char vbuf[64]; gstring vbytes (sizeof (vbuf), vbuf, false, 0); ldbSerialize (vbytes, value);
+      _sort.add (kbytes, vbytes);
+    }
+
+    /** Writes the sorted records into the database.
+     * @param compact Whether to run `CompactRange` over the whole database afterwards (pushing the freshly loaded tables down the levels).
+     * @return The number of records written. */
+    uint64_t finish (bool compact = true) {
+      leveldb::WriteBatch batch; uint32_t batchBytes = 0;
+      uint64_t records = 0, bytes = 0;
+      leveldb::WriteOptions options; options.sync = false;
+      auto flush = [&]() {
+        _ldb->write (batch, options);
+        batch.Clear(); batchBytes = 0;
+        if (_progress) _progress (records, bytes);
+      };
+      _sort.merge ([&] (const gstring& key, const gstring& value) {
+        batch.Put (leveldb::Slice (key.data(), key.size()), leveldb::Slice (value.data(), value.size()));
+        batchBytes += key.size() + value.size(); ++records; bytes += key.size() + value.size();
+        if (batchBytes >= _batchBytes) flush();
+      });
+      if (batchBytes) flush();
+      if (compact) _ldb->_db->CompactRange (nullptr, nullptr);
+      return records;
+    }
+  };
+  /** Creates a `BulkLoader` for this database.
+   * @param memoryLimit How much of the records to keep in memory before spilling them to disk.
+   * @param batchBytes The size of a single `WriteBatch`.
+   * @param tmpDir Where to keep the sorted runs. */
+  BulkLoader bulkLoader (size_t memoryLimit = 256 * 1024 * 1024, uint32_t batchBytes = 4 * 1024 * 1024, std::string tmpDir = "/tmp") {
+    return BulkLoader (this, memoryLimit, batchBytes, tmpDir);
   }
 
-  /** Writes the batch. Throws LdbEx if not successfull. */
+  /** Writes the batch. Throws LdbEx if not successfull.\n
+   * If there are async triggers then the change log records are written together with the batch. */
   void write (leveldb::WriteBatch& batch, leveldb::WriteOptions options = leveldb::WriteOptions()) {
+    ChangeLog* log = _changes.get();
+    if (log && log->_enabled) {writeLogged (log, batch, options); return;}
     leveldb::Status status (_db->Write (options, &batch));
     if (!status.ok()) GNTHROW (LdbEx, status.ToString());
   }
 
   virtual ~Ldb() {
+    _merging.reset(); // Stops the consolidation if this is the last copy.
+    _expiry.reset(); // Stops the expiry sweeper if this is the last copy.
+    _changes.reset(); // Stops the async triggers if this is the last copy.
     _triggers.clear(); // Destroy triggers before closing the database.
   }
 };
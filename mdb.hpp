@@ -29,13 +29,34 @@ limitations under the License.
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/range/iterator_range.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception> // exception_ptr
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric> // accumulate
+#include <thread>
+#include <type_traits>
+#include <vector>
+
 #include <arpa/inet.h> // htonl, ntohl
 
 #include "gstring.hpp"
+#include "ExternalSort.hpp"
 
 namespace glim {
 
-struct MdbEx: public std::runtime_error {MdbEx (std::string message): std::runtime_error (message) {}};
+/** `_rc` is the LMDB return code, when there is one (`MDB_MAP_FULL` is retried by `Mdb::write`). */
+struct MdbEx: public std::runtime_error {
+  int _rc;
+  MdbEx (std::string message, int rc = 0): std::runtime_error (message), _rc (rc) {}
+};
 
 template <typename T> inline void mdbSerialize (gstring& bytes, const T& data) {
   gstring_stream stream (bytes);
@@ -56,6 +77,46 @@ template <> inline void mdbDeserialize<uint32_t> (const gstring& bytes, uint32_t
   if (bytes.size() != sizeof (uint32_t)) throw MdbEx ("Not uint32_t, wrong number of bytes");
   uint32_t nui = * (uint32_t*) bytes.data(); ui = ntohl (nui);}
 
+/** Counts the bytes written into it. */
+struct MdbCountingBuf: public std::streambuf {
+  size_t _count = 0;
+  virtual int_type overflow (int_type ch) override {if (ch != traits_type::eof()) ++_count; return ch;}
+  virtual std::streamsize xsputn (const char*, std::streamsize count) override {_count += count; return count;}
+};
+/** The number of bytes `mdbSerialize` would produce. */
+template <typename T> inline size_t mdbSerializedSize (const T& data) {
+  MdbCountingBuf counter;
+  {boost::archive::binary_oarchive oa (counter, boost::archive::no_header); oa << data;}
+  return counter._count;
+}
+template <> inline size_t mdbSerializedSize<uint32_t> (const uint32_t&) {return sizeof (uint32_t);}
+template <> inline size_t mdbSerializedSize<gstring> (const gstring& data) {return data.size();}
+/** Writes into the `size` bytes at `place` and no further. */
+struct MdbPlacedBuf: public std::streambuf {
+  MdbPlacedBuf (char* place, size_t size) {setp (place, place + size);}
+  virtual int_type overflow (int_type ch) override {return traits_type::eof();} // Out of room.
+  size_t written() const {return pptr() - pbase();}
+};
+/** Serializes the `data` straight into the `size` bytes at `place` (`size` being the `mdbSerializedSize`). */
+template <typename T> inline void mdbSerializeInto (char* place, size_t size, const T& data) {
+  MdbPlacedBuf buf (place, size);
+  try {
+    boost::archive::binary_oarchive oa (buf, boost::archive::no_header);
+    oa << data;
+  } catch (const boost::archive::archive_exception&) {
+    throw MdbEx ("mdbSerializeInto: mdbSerializedSize mismatch");
+  }
+  if (buf.written() != size) throw MdbEx ("mdbSerializeInto: mdbSerializedSize mismatch");
+}
+template <> inline void mdbSerializeInto<uint32_t> (char* place, size_t size, const uint32_t& ui) {
+  if (size != sizeof (uint32_t)) throw MdbEx ("mdbSerializeInto: mdbSerializedSize mismatch");
+  uint32_t nui = htonl (ui); ::memcpy (place, &nui, sizeof (uint32_t));
+}
+template <> inline void mdbSerializeInto<gstring> (char* place, size_t size, const gstring& data) {
+  if (size != data.size()) throw MdbEx ("mdbSerializeInto: mdbSerializedSize mismatch");
+  ::memcpy (place, data.data(), size);
+}
+
 /** If the data is `gstring` then use the data's buffer directly, no copy. */
 template <> inline void mdbSerialize<gstring> (gstring& bytes, const gstring& data) {
   bytes = gstring (0, (void*) data.data(), false, data.length());}
@@ -63,31 +124,83 @@ template <> inline void mdbSerialize<gstring> (gstring& bytes, const gstring& da
 template <> inline void mdbDeserialize<gstring> (const gstring& bytes, gstring& data) {
   data.clear() << bytes;}
 
+/** Integer types kept as is (native-endian) in the `MDB_INTEGERKEY` and `MDB_INTEGERDUP` databases:
+ * LMDB compares `unsigned int` and `size_t` there. */
+template <typename T> struct MdbNativeInteger: public std::false_type {};
+template <> struct MdbNativeInteger<unsigned int>: public std::true_type {};
+template <> struct MdbNativeInteger<unsigned long>: public std::integral_constant<bool, sizeof (unsigned long) == sizeof (size_t)> {};
+template <> struct MdbNativeInteger<unsigned long long>: public std::integral_constant<bool, sizeof (unsigned long long) == sizeof (size_t)> {};
+
+/** `mdbSerialize` which passes the `MdbNativeInteger` types as is if the database keeps the bytes as `integer`s (no copy).\n
+ * `gstring`s are passed as is, other types can't be stored in the integer databases. */
+template <typename T> inline void mdbSerializeFor (bool integer, gstring& bytes, const T& data) {
+  if (!integer) mdbSerialize (bytes, data);
+  else if (MdbNativeInteger<T>::value) bytes = gstring (0, (void*) &data, false, sizeof (T));
+  else if (std::is_same<T, gstring>::value) mdbSerialize (bytes, data);
+  else throw MdbEx ("mdbSerializeFor: only unsigned int and size_t are stored in the integer databases");
+}
+/** `mdbDeserialize` counterpart of `mdbSerializeFor`. */
+template <typename T> inline void mdbDeserializeFor (bool integer, const gstring& bytes, T& data) {
+  if (!integer || !MdbNativeInteger<T>::value) {mdbDeserialize (bytes, data); return;}
+  if (bytes.size() != sizeof (T)) throw MdbEx ("mdbDeserializeFor: wrong number of bytes for an integer");
+  ::memcpy ((void*) &data, bytes.data(), sizeof (T));
+}
+
+/** Keeps the result of a mutation until the transaction is committed (see `Mdb::Writer` and `Mdb::write`). */
+template <typename R> struct MdbWriterResult {
+  R _value;
+  template <typename Fun, typename... Args> void apply (Fun& fun, Args&... args) {_value = fun (args...);}
+  void fulfil (std::promise<R>& promise) {promise.set_value (std::move (_value));}
+  R take() {return std::move (_value);}
+};
+template <> struct MdbWriterResult<void> {
+  template <typename Fun, typename... Args> void apply (Fun& fun, Args&... args) {fun (args...);}
+  void fulfil (std::promise<void>& promise) {promise.set_value();}
+  void take() {}
+};
+
 /**
  * Header-only C++ wrapper around OpenLDAP-MDB.\n
  * Uses Boost Serialization to pack keys and values (glim::gstring can be used for raw bytes).\n
+ * In the `MDB_INTEGERKEY` (`MDB_INTEGERDUP`) databases the `unsigned int` and `size_t` keys (values) are stored natively instead (see `MdbNativeInteger`).\n
  * Allows semi-automatic indexing with triggers.\n
+ * NB: The environments are opened with `MDB_NOTLS` (see `envFlags`): the reader slots belong to the transactions rather than to the threads,
+ * and a thread can have several read transactions open. An environment passed in from outside should be opened with it as well.\n
  * Known issues: http://www.openldap.org/its/index.cgi?findid=7448
  */
 struct Mdb {
   std::shared_ptr<MDB_env> _env;
   MDB_dbi _dbi = 0;
+  unsigned _dbFlags = 0; ///< The flags the database was opened with.
 
-  typedef std::unique_ptr<MDB_txn, void(*)(MDB_txn*)> Transaction;
+  struct MapGrowth;
+  /** Ends a `Transaction` which wasn't committed: `mdb_txn_abort`, unless constructed with another function (or `nullptr` for none).\n
+   * The transactions from `beginTransaction` carry their hold on the map growth (see `MapGrowth`), released after the end. */
+  struct TxnEnd {
+    void (*_abort) (MDB_txn*);
+    std::shared_ptr<MapGrowth> _growth; std::thread::id _holder;
+    TxnEnd (void (*abort) (MDB_txn*) = ::mdb_txn_abort): _abort (abort) {}
+    TxnEnd (std::shared_ptr<MapGrowth> growth): _abort (::mdb_txn_abort), _growth (std::move (growth)), _holder (std::this_thread::get_id()) {}
+    void operator() (MDB_txn* txn) {if (_abort) _abort (txn); release();}
+    /** Releases the hold on the map growth, if any. */
+    void release() {if (_growth) {_growth->release (_holder); _growth.reset();}}
+  };
+  typedef std::unique_ptr<MDB_txn, TxnEnd> Transaction;
 
   /** Holds the current key and value of the Iterator. */
   struct IteratorEntry {
     MDB_val _key = {0, 0}, _val = {0, 0};
+    unsigned _dbFlags = 0;
     /** Zero-copy view of the current key bytes. Should *not* be used after the Iterator is changed or destroyed. */
     const gstring keyView() const {return gstring (0, _key.mv_data, false, _key.mv_size, true);} // Zero copy.
     /** Zero-copy view of the current value bytes. Should *not* be used after the Iterator is changed or destroyed. */
     const gstring valueView() const {return gstring (0, _val.mv_data, false, _val.mv_size, true);} // Zero copy.
     /** Deserialize into `key`. */
-    template <typename T> void getKey (T& key) const {mdbDeserialize (keyView(), key);}
+    template <typename T> void getKey (T& key) const {mdbDeserializeFor (_dbFlags & MDB_INTEGERKEY, keyView(), key);}
     /** Deserialize the key into a temporary and return it. */
     template <typename T> T getKey() const {T key; getKey (key); return key;}
     /** Deserialize into `value`. */
-    template <typename T> void getValue (T& value) const {mdbDeserialize (valueView(), value);}
+    template <typename T> void getValue (T& value) const {mdbDeserializeFor (_dbFlags & MDB_INTEGERDUP, valueView(), value);}
     /** Deserialize the value into a temporary and return it. */
     template <typename T> T getValue() const {T value; getValue (value); return value;}
   };
@@ -113,6 +226,7 @@ struct Mdb {
     /** Iterate from the beginning or the end of the database.
      * @param position can be MDB_FIRST or MDB_LAST */
     Iterator (Mdb* mdb, int position = 0): _stayInKey (false) {
+      _entry._dbFlags = mdb->_dbFlags;
       Transaction txn (mdb->beginTransaction());
       MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), mdb->_dbi, &cur);
       if (rc) throw MdbEx ("mdb_cursor_open");
@@ -125,6 +239,7 @@ struct Mdb {
     /** Iterate over `key` values.
      * @param stayInKey if `false` then iterator can go farther than the `key`. */
     Iterator (Mdb* mdb, const gstring& key, bool stayInKey = true): _stayInKey (stayInKey) {
+      _entry._dbFlags = mdb->_dbFlags;
       Transaction txn (mdb->beginTransaction());
       MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), mdb->_dbi, &cur);
       if (rc) throw MdbEx ("mdb_cursor_open");
@@ -168,7 +283,7 @@ struct Mdb {
   template <typename K> Iterator values (const K& key) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     return Iterator (this, kbytes);
   }
   /** Range over the `key` values.\n
@@ -187,20 +302,450 @@ struct Mdb {
     _triggers[trigger->getTriggerName()] = trigger;
   }
 
-  /** `flags` can be `MDB_RDONLY` */
+  /** Runs the triggers on a background thread in batched transactions, keeping them out of the write transactions (see `setAsyncTriggers`).\n
+   * The writes append compact change records (the operation, the time, the key and the value bytes) to a log database in the same environment.
+   * The indexer applies them in the log order and removes them. The log survives restarts, and the leftover changes are applied by the next indexer.\n
+   * The triggers get `nullptr` for the key and the value objects (the serialized bytes are there).
+   * `erase` is logged as an `eraseKV` of every value of the key, since the values are gone by the time the indexer runs. */
+  struct AsyncTriggers {
+    Mdb* _mdb;
+    std::unique_ptr<Mdb> _log;
+    std::unique_ptr<Mdb> _progress; ///< The sequence number of the last change applied, which the log continues from once emptied.
+    uint32_t _maxBatch;
+    std::mutex _mutex; std::condition_variable _wake, _applied; ///< Wake the indexer and signal the applied changes.
+    bool _stop = false, _dirty = false;
+    std::atomic<bool> _stopped {false}; ///< Set by `stop`, sending the copies of the Mdb back to the synchronous triggers.
+    std::atomic<bool> _appended {false}; ///< Set by the writes, checked on commit.
+    uint64_t _appliedSeq = 0; ///< The last change applied.
+    std::exception_ptr _error; ///< The last failure of the indexer, cleared by a successful batch.
+    uint64_t _failures = 0; ///< Incremented with every `_error`, allowing `waitForIndexes` to only see the failures happening while it waits.
+    std::atomic<uint64_t> _changes {0}, _batches {0};
+    std::thread _thread;
+
+    AsyncTriggers (Mdb* mdb, const char* logDbName, uint32_t maxBatch):
+      _mdb (mdb), _log (new Mdb (mdb->_env, logDbName, false)), _progress (new Mdb (mdb->_env, (std::string (logDbName) + "Progress").c_str(), false)),
+      _maxBatch (std::max (maxBatch, 1u)) {
+      {ReadTransaction txn (*_progress); _appliedSeq = appliedIn (txn._txn.get());}
+      _thread = std::thread (&AsyncTriggers::loop, this);
+    }
+    /** Change records are keyed by a big-endian sequence number. */
+    static uint64_t seqOf (const MDB_val& key) {
+      uint64_t seq = 0; for (size_t pos = 0; pos < key.mv_size; ++pos) seq = (seq << 8) | ((const uint8_t*) key.mv_data)[pos];
+      return seq;}
+    /** The last change applied, as recorded by `applyBatch` in the `_progress`. */
+    uint64_t appliedIn (MDB_txn* txn) {
+      MDB_val mkey = {7, (void*) "applied"}, mval;
+      int rc = ::mdb_get (txn, _progress->_dbi, &mkey, &mval);
+      if (rc == MDB_NOTFOUND) return 0;
+      if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_get: ") + ::mdb_strerror (rc), rc);
+      return seqOf (mval);
+    }
+
+    /** Logs a change. `op` is 'a' for `add` and 'k' for `eraseKV`. */
+    void append (Transaction& txn, char op, const gstring& kbytes, const gstring& vbytes) {
+      MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), _log->_dbi, &cur);
+      if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+      std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+      MDB_val mkey, mval; rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_LAST);
+      if (rc && rc != MDB_NOTFOUND) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+      uint64_t seq = (rc ? appliedIn (txn.get()) : seqOf (mkey)) + 1;
+      char seqBytes[8]; for (int pos = 7; pos >= 0; --pos, seq >>= 8) seqBytes[pos] = (char) (seq & 0xFF);
+      const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::system_clock::now().time_since_epoch()).count();
+      const uint32_t klen = kbytes.size();
+      char buf[128]; gstring record (sizeof (buf), buf, false, 0);
+      record.append (&op, 1); record.append ((const char*) &micros, 8); record.append ((const char*) &klen, 4);
+      record.append (kbytes.data(), klen); record.append (vbytes.data(), vbytes.size());
+      mkey = {sizeof (seqBytes), seqBytes}; mval = {record.size(), (void*) record.data()};
+      rc = ::mdb_cursor_put (cur, &mkey, &mval, MDB_APPEND);
+      if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_put: ") + ::mdb_strerror (rc), rc);
+      _appended = true;
+    }
+
+    /** Applies up to `_maxBatch` changes in a transaction.
+     * @return The number of changes applied. */
+    size_t applyBatch() {
+      {ReadTransaction peek (*_log); MDB_stat st;
+        int rc = ::mdb_stat (peek._txn.get(), _log->_dbi, &st);
+        if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_stat: ") + ::mdb_strerror (rc), rc);
+        if (!st.ms_entries) return 0;}
+      uint64_t lastSeq = 0;
+      size_t count = _mdb->write ([&] (Transaction& txn) -> size_t {
+        MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), _log->_dbi, &cur);
+        if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+        std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+        gstring kbytes, vbytes; MDB_val mkey, mval; size_t count = 0;
+        for (rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_FIRST); rc == 0 && count < _maxBatch; rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_NEXT)) {
+          const char* data = (const char*) mval.mv_data; uint32_t klen = 0;
+          if (mval.mv_size < 13 || (::memcpy (&klen, data + 9, 4), 13 + (size_t) klen > mval.mv_size)) throw MdbEx ("AsyncTriggers: corrupt change record");
+          kbytes.clear(); kbytes.append (data + 13, klen);
+          vbytes.clear(); vbytes.append (data + 13 + klen, mval.mv_size - 13 - klen);
+          for (auto& trigger: _mdb->_triggers) {
+            if (data[0] == 'a') trigger.second->add (*_mdb, nullptr, kbytes, nullptr, vbytes, txn);
+            else trigger.second->eraseKV (*_mdb, nullptr, kbytes, nullptr, vbytes, txn);
+          }
+          lastSeq = seqOf (mkey); ++count;
+        }
+        if (rc && rc != MDB_NOTFOUND) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+        for (size_t num = 0; num < count; ++num) {
+          rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_FIRST);
+          if (rc == 0) rc = ::mdb_cursor_del (cur, 0);
+          if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_del: ") + ::mdb_strerror (rc), rc);
+        }
+        if (count) {
+          char seqBytes[8]; uint64_t seq = lastSeq; for (int pos = 7; pos >= 0; --pos, seq >>= 8) seqBytes[pos] = (char) (seq & 0xFF);
+          mkey = {7, (void*) "applied"}; mval = {sizeof (seqBytes), seqBytes};
+          rc = ::mdb_put (txn.get(), _progress->_dbi, &mkey, &mval, 0);
+          if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_put: ") + ::mdb_strerror (rc), rc);
+        }
+        return count;});
+      std::lock_guard<std::mutex> lock (_mutex);
+      _appliedSeq = lastSeq; _error = nullptr; _changes += count; ++_batches;
+      _applied.notify_all();
+      return count;
+    }
+    /** Wakes up on the commits (`notify`), otherwise polls the log for the changes committed elsewhere. */
+    void loop() {
+      for (;;) {
+        bool stop;
+        {std::unique_lock<std::mutex> lock (_mutex);
+          _wake.wait_for (lock, std::chrono::milliseconds (100), [this]() {return _stop || _dirty;});
+          _dirty = false; stop = _stop;}
+        try {
+          while (applyBatch() == _maxBatch) {}
+        } catch (...) {
+          std::lock_guard<std::mutex> lock (_mutex);
+          _error = std::current_exception(); ++_failures; _applied.notify_all();
+        }
+        if (stop) return;
+      }
+    }
+    void notify() {
+      {std::lock_guard<std::mutex> lock (_mutex); _dirty = true;}
+      _wake.notify_one();
+    }
+    /** The sequence number of the last change logged and committed (the last one applied when the log is empty). */
+    uint64_t lastSeq() {
+      ReadTransaction txn (*_log);
+      MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn._txn.get(), _log->_dbi, &cur);
+      if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+      std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+      MDB_val mkey, mval; rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_LAST);
+      if (rc == MDB_NOTFOUND) return appliedIn (txn._txn.get());
+      if (rc) throw MdbEx (std::string ("AsyncTriggers, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+      return seqOf (mkey);
+    }
+    /** Applies the remaining changes and stops the indexer.
+     * Called by the Mdb the indexer was set on (`_mdb`) before it goes away, the copies sharing the `AsyncTriggers` then run the triggers synchronously.
+     * A change logged by a copy while the indexer stops stays in the log till the next `setAsyncTriggers` with it. */
+    void stop() {
+      {std::lock_guard<std::mutex> lock (_mutex); _stop = true;}
+      _wake.notify_one();
+      if (_thread.joinable()) _thread.join();
+      _stopped = true;
+      std::lock_guard<std::mutex> lock (_mutex); _applied.notify_all();
+    }
+    ~AsyncTriggers() {stop();}
+  };
+  /// NB: The copies of the Mdb share the indexer, which runs the triggers of the Mdb it was set on and is stopped with it.
+  std::shared_ptr<AsyncTriggers> _asyncTriggers;
+  /** Whether the changes are logged for a running indexer. */
+  bool asyncTriggers() const {return _asyncTriggers && !_asyncTriggers->_stopped;}
+
+  /** Moves the triggers out of the write transactions to a background indexer (see `AsyncTriggers`),
+   * making the write transactions shorter at the cost of the indexes lagging behind the data (see `triggerLag` and `waitForIndexes`).\n
+   * There should be a single indexer per log.
+   * @param logDbName The database keeping the changes, in the same environment. The sequence of the last change applied is kept in `logDbName` + "Progress".
+   * @param maxBatch The maximum number of changes applied in a single transaction. */
+  void setAsyncTriggers (const char* logDbName = "triggerLog", uint32_t maxBatch = 1024) {
+    if (asyncTriggers()) throw MdbEx ("setAsyncTriggers: the triggers are asynchronous already");
+    _asyncTriggers = std::make_shared<AsyncTriggers> (this, logDbName, maxBatch);
+  }
+  /** Applies the logged changes and goes back to running the triggers in the write transactions. */
+  void stopAsyncTriggers() {
+    if (_asyncTriggers && _asyncTriggers->_mdb == this) _asyncTriggers->stop();
+    _asyncTriggers.reset();
+  }
+
+  /** Waits for the indexer to apply the changes committed before the call. Rethrows the error of the indexer failing during the wait. */
+  void waitForIndexes() {
+    if (!asyncTriggers()) return;
+    AsyncTriggers& async = *_asyncTriggers;
+    const uint64_t target = async.lastSeq();
+    std::unique_lock<std::mutex> lock (async._mutex);
+    if (async._appliedSeq >= target) return;
+    const uint64_t failures = async._failures;
+    lock.unlock(); async.notify(); lock.lock();
+    async._applied.wait (lock, [&]() {return async._appliedSeq >= target || async._failures != failures || async._stopped;});
+    if (async._appliedSeq < target && async._failures != failures) std::rethrow_exception (async._error);
+  }
+
+  struct TriggerLag {
+    uint64_t _pending = 0; ///< The changes waiting in the log.
+    double _lagSeconds = 0; ///< The age of the oldest pending change.
+    uint64_t _applied = 0, _batches = 0; ///< The changes applied by the indexer and the transactions it took.
+  };
+  TriggerLag triggerLag() {
+    TriggerLag lag;
+    if (!_asyncTriggers) return lag;
+    AsyncTriggers& async = *_asyncTriggers;
+    lag._applied = async._changes; lag._batches = async._batches;
+    ReadTransaction txn (*async._log);
+    MDB_stat st; int rc = ::mdb_stat (txn._txn.get(), async._log->_dbi, &st);
+    if (rc) throw MdbEx (std::string ("triggerLag, mdb_stat: ") + ::mdb_strerror (rc), rc);
+    lag._pending = st.ms_entries;
+    MDB_cursor* cur = nullptr; rc = ::mdb_cursor_open (txn._txn.get(), async._log->_dbi, &cur);
+    if (rc) throw MdbEx (std::string ("triggerLag, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+    std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+    MDB_val mkey, mval; rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_FIRST);
+    if (rc == 0 && mval.mv_size >= 9) {
+      int64_t micros; ::memcpy (&micros, (const char*) mval.mv_data + 1, 8);
+      const int64_t now = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::system_clock::now().time_since_epoch()).count();
+      lag._lagSeconds = std::max (now - micros, (int64_t) 0) / 1e6;
+    }
+    return lag;
+  }
+
+ protected:
+  /** Runs the `add` triggers or logs the change for the `AsyncTriggers`. */
+  void triggerAdd (void* key, gstring& kbytes, void* value, gstring& vbytes, Transaction& txn) {
+    if (asyncTriggers()) {if (!_triggers.empty()) _asyncTriggers->append (txn, 'a', kbytes, vbytes); return;}
+    for (auto& trigger: _triggers) trigger.second->add (*this, key, kbytes, value, vbytes, txn);
+  }
+  void triggerEraseKV (void* key, gstring& kbytes, void* value, gstring& vbytes, Transaction& txn) {
+    if (asyncTriggers()) {if (!_triggers.empty()) _asyncTriggers->append (txn, 'k', kbytes, vbytes); return;}
+    for (auto& trigger: _triggers) trigger.second->eraseKV (*this, key, kbytes, value, vbytes, txn);
+  }
+  /** For the `AsyncTriggers` logs an `eraseKV` of every value of the key. */
+  void triggerErase (void* key, gstring& kbytes, Transaction& txn) {
+    if (!asyncTriggers()) {for (auto& trigger: _triggers) trigger.second->erase (*this, key, kbytes, txn); return;}
+    if (_triggers.empty()) return;
+    MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), _dbi, &cur);
+    if (rc) throw MdbEx (std::string ("triggerErase, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+    std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+    MDB_val mkey = {kbytes.size(), (void*) kbytes.data()}, mval = {0, 0};
+    gstring vbytes;
+    for (rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_SET_KEY); rc == 0; rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_NEXT_DUP)) {
+      vbytes.clear(); vbytes.append ((const char*) mval.mv_data, mval.mv_size); // Copied before the log is written to.
+      _asyncTriggers->append (txn, 'k', kbytes, vbytes);
+      if (!(_dbFlags & MDB_DUPSORT)) break;
+    }
+    if (rc && rc != MDB_NOTFOUND) throw MdbEx (std::string ("triggerErase, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+  }
+ public:
+
+  /** Read-only transactions cached per thread between the reads: `mdb_txn_reset` after a read and `mdb_txn_renew` before the next one.\n
+   * With `_maxStalenessUs` the transaction is kept active between the reads, skipping the renew for that long
+   * (the reads might then miss the recent writes of the other Mdb instances and processes, but not the writes committed through this Mdb).
+   * The active transactions pin the pages freed by the later commits, hence the idle ones are reset on every commit through this Mdb
+   * and a transaction past its staleness allowance is reset when returned to the cache.\n
+   * A reset transaction still keeps its reader slot, hence the transaction of a thread is aborted when the thread exits (see `ThreadSlots`). */
+  struct ReadTxnPool {
+    struct Slot {MDB_txn* _txn = nullptr; bool _active = false; uint32_t _users = 0; int64_t _renewedAt = 0; uint64_t _commits = 0;};
+    std::mutex _mutex; ///< Guards the `_slots` map and the `_users` counters.
+    std::map<std::thread::id, Slot> _slots;
+    std::atomic<uint64_t> _commits {0}; ///< Transactions committed through this Mdb, a cached transaction older than the last commit is renewed.
+    std::atomic<uint32_t> _maxStalenessUs {0};
+    /** Aborts the cached transactions which aren't in use. */
+    void clear() {
+      std::lock_guard<std::mutex> lock (_mutex);
+      for (auto it = _slots.begin(); it != _slots.end();) {
+        if (it->second._users) {++it; continue;}
+        if (it->second._txn) ::mdb_txn_abort (it->second._txn);
+        it = _slots.erase (it);
+      }
+    }
+    /** Aborts the cached transaction of the `thread`. */
+    void drop (std::thread::id thread) {
+      std::lock_guard<std::mutex> lock (_mutex);
+      auto it = _slots.find (thread);
+      if (it == _slots.end() || it->second._users) return;
+      if (it->second._txn) ::mdb_txn_abort (it->second._txn);
+      _slots.erase (it);
+    }
+    /** Resets the active transactions which aren't in use (on the idle threads). */
+    void resetIdle() {
+      std::lock_guard<std::mutex> lock (_mutex);
+      for (auto& slot: _slots) if (!slot.second._users && slot.second._active) {::mdb_txn_reset (slot.second._txn); slot.second._active = false;}
+    }
+    /** Resets the active transactions. Invoked by the map growth, when none of them is borrowed (see `MapGrowth`). */
+    void resetAll() {
+      std::lock_guard<std::mutex> lock (_mutex);
+      for (auto& slot: _slots) if (slot.second._active) {::mdb_txn_reset (slot.second._txn); slot.second._active = false;}
+    }
+    ~ReadTxnPool() {for (auto& slot: _slots) if (slot.second._txn) ::mdb_txn_abort (slot.second._txn);}
+  };
+  std::shared_ptr<ReadTxnPool> _readTxns = std::make_shared<ReadTxnPool>();
+  /** The pools a thread has a cached transaction in, which it drops them from when it exits. */
+  struct ThreadSlots {
+    std::vector<std::weak_ptr<ReadTxnPool>> _pools;
+    void add (const std::shared_ptr<ReadTxnPool>& pool) {
+      _pools.erase (std::remove_if (_pools.begin(), _pools.end(), [](const std::weak_ptr<ReadTxnPool>& pool) {return pool.expired();}), _pools.end());
+      _pools.push_back (pool);
+    }
+    ~ThreadSlots() {
+      const std::thread::id thread = std::this_thread::get_id();
+      for (auto& pool: _pools) if (auto live = pool.lock()) live->drop (thread);
+    }
+    static ThreadSlots& get() {static thread_local ThreadSlots slots; return slots;}
+  };
+
+  /** Coordinates the growth of the memory map (`mdb_env_set_mapsize`) between the Mdb instances of an environment (see `write`).\n
+   * Every transaction of the process holds the growth off: the borrowed reads (`ReadTransaction`) and the transactions from `beginTransaction`.
+   * The growth waits for the holds to be released and keeps the new ones waiting, save for the threads holding already (which it waits for).\n
+   * A thread can't resize the map while it holds a transaction itself: `beginGrowth` throws instead of waiting for the thread forever. */
+  struct MapGrowth {
+    std::mutex _mutex; std::condition_variable _changed;
+    uint32_t _holds = 0; bool _growing = false;
+    std::map<std::thread::id, uint32_t> _holders; ///< The holds per thread.
+    std::atomic<double> _factor {2.0};
+    std::atomic<size_t> _maxBytes {0}; ///< Zero for no limit.
+    std::atomic<uint64_t> _growths {0};
+    std::mutex _poolsMutex; std::vector<std::weak_ptr<ReadTxnPool>> _pools; ///< The cached read transactions to reset before a growth.
+
+    /** Holds the growth off for the current thread.
+     * Doesn't wait for a pending growth if the thread holds already or if not to `wait` (a thread working on the transactions of a holder). */
+    void hold (bool wait = true) {
+      const std::thread::id thread = std::this_thread::get_id();
+      std::unique_lock<std::mutex> lock (_mutex);
+      if (wait && !_holders.count (thread)) _changed.wait (lock, [this]() {return !_growing;});
+      ++_holders[thread]; ++_holds;
+    }
+    /** Releases a hold of the `thread`. */
+    void release (std::thread::id thread = std::this_thread::get_id()) {
+      std::lock_guard<std::mutex> lock (_mutex);
+      auto it = _holders.find (thread); if (it == _holders.end()) return;
+      if (!--it->second) _holders.erase (it);
+      if (!--_holds) _changed.notify_all();
+    }
+    /** Waits for the holds to be released and keeps the new ones waiting till `endGrowth`.
+     * Throws `MdbEx` with the `rc` if the current thread holds the growth off. */
+    void beginGrowth (int rc) {
+      std::unique_lock<std::mutex> lock (_mutex);
+      if (_holders.count (std::this_thread::get_id())) throw MdbEx ("MapGrowth: can't resize the map while the thread has a transaction open", rc);
+      _changed.wait (lock, [this]() {return !_growing;});
+      _growing = true;
+      _changed.wait (lock, [this]() {return !_holds;});
+    }
+    void endGrowth() {std::lock_guard<std::mutex> lock (_mutex); _growing = false; _changed.notify_all();}
+
+    /** Holds the growth off for the scope (see `hold`). */
+    struct Holding: boost::noncopyable {
+      MapGrowth& _growth;
+      Holding (MapGrowth& growth, bool wait = true): _growth (growth) {growth.hold (wait);}
+      ~Holding() {_growth.release();}
+    };
+    /** Grows the map in the scope (see `beginGrowth`). */
+    struct Resizing: boost::noncopyable {
+      MapGrowth& _growth;
+      Resizing (MapGrowth& growth, int rc): _growth (growth) {growth.beginGrowth (rc);}
+      ~Resizing() {_growth.endGrowth();}
+    };
+  };
+  std::shared_ptr<MapGrowth> _growth;
+  /** The `MapGrowth` shared by the Mdb instances of the `env` (looked up when an Mdb is opened, see `attach`). */
+  static std::shared_ptr<MapGrowth> mapGrowth (MDB_env* env) {
+    static std::mutex mutex; static std::map<MDB_env*, std::weak_ptr<MapGrowth>> growths;
+    std::lock_guard<std::mutex> lock (mutex);
+    for (auto it = growths.begin(); it != growths.end();) if (it->second.expired()) it = growths.erase (it); else ++it;
+    std::shared_ptr<MapGrowth> growth = growths[env].lock();
+    if (!growth) {growth = std::make_shared<MapGrowth>(); growths[env] = growth;}
+    return growth;
+  }
+
+  /** A read-only transaction borrowed from the per-thread cache (see `ReadTxnPool`).\n
+   * Nested reads on the same thread share the transaction. The `_txn` must not be committed or aborted.\n
+   * Example: \code Mdb::ReadTransaction txn (mdb); mdb.first (key1, value1, txn._txn); mdb.first (key2, value2, txn._txn); \endcode */
+  struct ReadTransaction: boost::noncopyable {
+    std::shared_ptr<ReadTxnPool> _pool;
+    std::shared_ptr<MapGrowth> _growth; bool _locked = false; ///< The outermost read holds the growth off.
+    ReadTxnPool::Slot* _slot;
+    Transaction _txn;
+    ReadTransaction (Mdb& mdb): _pool (mdb._readTxns), _growth (mdb._growth), _slot (nullptr), _txn (nullptr, TxnEnd (nullptr)) {
+      ReadTxnPool* pool = _pool.get();
+      bool added;
+      {std::lock_guard<std::mutex> lock (pool->_mutex);
+        auto it = pool->_slots.emplace (std::this_thread::get_id(), ReadTxnPool::Slot());
+        _slot = &it.first->second; added = it.second;
+        ++_slot->_users;}
+      if (added) ThreadSlots::get().add (_pool);
+      try {
+        if (_slot->_users == 1) {
+          _growth->hold(); _locked = true;
+          const int64_t now = std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now().time_since_epoch()).count();
+          const uint64_t commits = pool->_commits;
+          if (_slot->_active && (commits != _slot->_commits || now - _slot->_renewedAt > (int64_t) pool->_maxStalenessUs)) {
+            ::mdb_txn_reset (_slot->_txn); _slot->_active = false;}
+          while (!_slot->_active) {
+            const bool begin = !_slot->_txn;
+            int rc = begin ? ::mdb_txn_begin (mdb._env.get(), nullptr, MDB_RDONLY, &_slot->_txn) : ::mdb_txn_renew (_slot->_txn);
+            if (rc && begin) _slot->_txn = nullptr;
+            if (rc == MDB_MAP_RESIZED) { // Another process has grown the map.
+              _growth->release(); _locked = false;
+              mdb.adoptMapSize();
+              _growth->hold(); _locked = true;
+              continue;
+            }
+            if (rc) throw MdbEx (std::string (begin ? "mdb_txn_begin: " : "mdb_txn_renew: ") + ::mdb_strerror (rc), rc);
+            _slot->_active = true; _slot->_renewedAt = now; _slot->_commits = commits;
+          }
+        }
+      } catch (...) {release(); throw;}
+      _txn.reset (_slot->_txn);
+    }
+    void release() {
+      if (_slot->_users == 1 && _slot->_active) {
+        const int64_t maxStalenessUs = _pool->_maxStalenessUs;
+        const int64_t now = maxStalenessUs ? std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+        if (!maxStalenessUs || _pool->_commits != _slot->_commits || now - _slot->_renewedAt > maxStalenessUs) {
+          ::mdb_txn_reset (_slot->_txn); _slot->_active = false;}
+      }
+      if (_locked) {_growth->release(); _locked = false;}
+      std::lock_guard<std::mutex> lock (_pool->_mutex);
+      --_slot->_users;
+    }
+    ~ReadTransaction() {_txn.reset(); release();}
+  };
+  /** Allows the cached read transactions to be reused without a renew for up to `micros` microseconds (see `ReadTxnPool`).
+   * Zero (the default) renews the transaction before every read. */
+  void setReadStaleness (uint32_t micros) {_readTxns->_maxStalenessUs = micros;}
+  /** Aborts the idle cached read transactions (the transactions of a thread are aborted when it exits anyway). */
+  void clearReadTransactions() {_readTxns->clear();}
+
+  /** Serializes the key, natively for the `MDB_INTEGERKEY` databases (see `mdbSerializeFor`). */
+  template <typename K> void keyBytes (gstring& kbytes, const K& key) const {mdbSerializeFor (_dbFlags & MDB_INTEGERKEY, kbytes, key);}
+  /** Serializes the value, natively for the `MDB_INTEGERDUP` databases (see `mdbSerializeFor`). */
+  template <typename V> void valueBytes (gstring& vbytes, const V& value) const {mdbSerializeFor (_dbFlags & MDB_INTEGERDUP, vbytes, value);}
+  template <typename V> void valueFrom (const gstring& vbytes, V& value) const {mdbDeserializeFor (_dbFlags & MDB_INTEGERDUP, vbytes, value);}
+
+  /** `flags` can be `MDB_RDONLY`.\n
+   * The transaction holds the map growth off until it is committed or aborted (see `MapGrowth`).
+   * On `MDB_MAP_RESIZED` the map size set by another process is adopted first (see `adoptMapSize`). */
   Transaction beginTransaction (unsigned flags = 0) {
-    MDB_txn* txn = 0; int rc = ::mdb_txn_begin (_env.get(), nullptr, flags, &txn);
-    if (rc) throw MdbEx (std::string ("mdb_txn_begin: ") + ::strerror (rc));
-    return Transaction (txn, ::mdb_txn_abort);
+    for (;;) {
+      _growth->hold();
+      MDB_txn* txn = 0; int rc = ::mdb_txn_begin (_env.get(), nullptr, flags, &txn);
+      if (!rc) return Transaction (txn, TxnEnd (_growth));
+      _growth->release();
+      if (rc != MDB_MAP_RESIZED) throw MdbEx (std::string ("mdb_txn_begin: ") + ::mdb_strerror (rc), rc);
+      adoptMapSize();
+    }
   }
   void commitTransaction (Transaction& txn) {
     int rc = ::mdb_txn_commit (txn.get());
     txn.release(); // Must prevent `mdb_txn_abort` from happening (even if rc != 0).
-    if (rc) throw MdbEx (std::string ("mdb_txn_commit: ") + ::strerror (rc));
+    txn.get_deleter().release();
+    if (rc) throw MdbEx (std::string ("mdb_txn_commit: ") + ::mdb_strerror (rc), rc);
+    ++_readTxns->_commits;
+    if (_readTxns->_maxStalenessUs) _readTxns->resetIdle(); // The idle readers would pin the pages this commit has freed.
+    if (_asyncTriggers && _asyncTriggers->_appended.exchange (false)) _asyncTriggers->notify();
   }
 
+  /** `MDB_NOTLS` ties the reader slots to the transactions rather than to the threads,
+   * allowing for the cached read transactions (`ReadTransaction`) of several Mdb instances on the same thread
+   * and for the `parallelScan` handing its transactions over to the scanning threads.\n
+   * NB: This differs from the LMDB default; an override dropping `MDB_NOTLS` should use a single Mdb per environment and no `parallelScan`. */
   virtual unsigned envFlags (uint8_t sync) {
-    unsigned flags = MDB_NOSUBDIR;
+    unsigned flags = MDB_NOSUBDIR | MDB_NOTLS;
     if (sync < 1) flags |= MDB_NOSYNC; else if (sync < 2) flags |= MDB_NOMETASYNC;
     return flags;
   }
@@ -209,22 +754,34 @@ struct Mdb {
     int rc = ::mdb_env_set_maxdbs (env, 32);
     if (rc) throw MdbEx (std::string ("envConf: ") + ::strerror (rc));
   }
+  /** NB: Invoked from the constructor, where the overrides of the derived classes aren't in effect yet; pass the `flags` to the constructor instead. */
   virtual void dbFlags (unsigned& flags) {}
 
  protected:
-  void open (const char* dbName, bool dup) {
+  /** Joins the `MapGrowth` of the environment. */
+  void attach() {
+    _growth = mapGrowth (_env.get());
+    std::lock_guard<std::mutex> lock (_growth->_poolsMutex);
+    auto& pools = _growth->_pools;
+    pools.erase (std::remove_if (pools.begin(), pools.end(), [](const std::weak_ptr<ReadTxnPool>& pool) {return pool.expired();}), pools.end());
+    pools.push_back (_readTxns);
+  }
+  void open (const char* dbName, bool dup, unsigned extraFlags) {
     auto txn = beginTransaction();
-    unsigned flags = MDB_CREATE;
+    unsigned flags = MDB_CREATE | extraFlags;
     if (dup) flags |= MDB_DUPSORT;
     dbFlags (flags);
     int rc = ::mdb_open (txn.get(), dbName, flags, &_dbi);
     if (rc) throw MdbEx (std::string ("mdb_open (") + dbName + "): " + ::strerror (rc));
+    rc = ::mdb_dbi_flags (txn.get(), _dbi, &_dbFlags); // An existing database keeps the flags it was created with.
+    if (rc) throw MdbEx (std::string ("mdb_dbi_flags (") + dbName + "): " + ::strerror (rc));
     commitTransaction (txn);
   }
  public:
 
-  /** Opens MDB environment and MDB database. */
-  Mdb (const char* path, size_t maxSizeMb = 1024, const char* dbName = "main", uint8_t sync = 0, bool dup = true, mode_t mode = 0660) {
+  /** Opens MDB environment and MDB database.
+   * @param flags Additional database flags, such as `MDB_DUPFIXED | MDB_INTEGERDUP` (see `addFixed`). */
+  Mdb (const char* path, size_t maxSizeMb = 1024, const char* dbName = "main", uint8_t sync = 0, bool dup = true, mode_t mode = 0660, unsigned flags = 0) {
     MDB_env* env = 0; int rc = ::mdb_env_create (&env);
     if (rc) throw MdbEx (std::string ("mdb_env_create: ") + ::strerror (rc));
     _env.reset (env, ::mdb_env_close);
@@ -232,61 +789,425 @@ struct Mdb {
     if (rc) throw MdbEx (std::string ("mdb_env_set_mapsize: ") + ::strerror (rc));
     envConf (env);
     rc = ::mdb_env_open (env, path, envFlags (sync), mode);
-    _dbi = 0; open (dbName, dup);
+    _dbi = 0; attach(); open (dbName, dup, flags);
+  }
+
+  /** Opens MDB database in the provided environment.
+   * @param flags Additional database flags, such as `MDB_DUPFIXED | MDB_INTEGERDUP` (see `addFixed`). */
+  Mdb (std::shared_ptr<MDB_env> env, const char* dbName, bool dup = true, unsigned flags = 0): _env (env), _dbi (0) {
+    attach(); open (dbName, dup, flags);
+  }
+
+  /** The memory map usage (from `mdb_env_info` and `mdb_env_stat`). */
+  struct MapStats {
+    size_t _mapSize = 0, _pageSize = 0;
+    size_t _mapPages = 0; ///< The number of pages the map can hold.
+    size_t _usedPages = 0; ///< The pages allocated so far (the last page number plus one), including the pages freed and reused by the later transactions.
+    size_t _lastTxnId = 0;
+    unsigned _readers = 0, _maxReaders = 0;
+    uint64_t _growths = 0; ///< How many times the map was grown by this process (see `write`).
+    /** The pages never allocated yet. */
+    size_t freePages() const {return _mapPages > _usedPages ? _mapPages - _usedPages : 0;}
+    /** The allocated share of the map. */
+    double used() const {return _mapPages ? (double) _usedPages / _mapPages : 0;}
+  };
+  MapStats mapStats() {
+    MapGrowth::Holding holding (*_growth);
+    MDB_envinfo info; int rc = ::mdb_env_info (_env.get(), &info);
+    if (rc) throw MdbEx (std::string ("mdb_env_info: ") + ::mdb_strerror (rc), rc);
+    MDB_stat st; rc = ::mdb_env_stat (_env.get(), &st);
+    if (rc) throw MdbEx (std::string ("mdb_env_stat: ") + ::mdb_strerror (rc), rc);
+    MapStats stats;
+    stats._mapSize = info.me_mapsize; stats._pageSize = st.ms_psize;
+    stats._mapPages = st.ms_psize ? info.me_mapsize / st.ms_psize : 0;
+    stats._usedPages = info.me_last_pgno + 1;
+    stats._lastTxnId = info.me_last_txnid;
+    stats._readers = info.me_numreaders; stats._maxReaders = info.me_maxreaders;
+    stats._growths = _growth->_growths;
+    return stats;
   }
 
-  /** Opens MDB database in the provided environment. */
-  Mdb (std::shared_ptr<MDB_env> env, const char* dbName, bool dup = true): _env (env), _dbi (0) {
-    open (dbName, dup);
+  /** Configures the growth of the memory map on `MDB_MAP_FULL` (see `write`), for all the Mdb instances of the environment.
+   * @param factor The map size is multiplied by it.
+   * @param maxBytes The map doesn't grow beyond that, zero for no limit. */
+  void setMapGrowth (double factor, size_t maxBytes = 0) {
+    if (!(factor > 1.0)) throw MdbEx ("setMapGrowth: the factor should be above 1");
+    _growth->_factor = factor; _growth->_maxBytes = maxBytes;
+  }
+
+ protected:
+  /** Invoked in a `MapGrowth::Resizing`: no transactions of the process are open. */
+  void resizeMap (size_t bytes) {
+    {std::lock_guard<std::mutex> lock (_growth->_poolsMutex);
+      for (auto& pool: _growth->_pools) if (auto live = pool.lock()) live->resetAll();}
+    int rc;
+    // `mdb_env_set_mapsize` refuses to work during a write transaction, such as one of another `MDB_env` opened on the same file (not covered by this `MapGrowth`).
+    for (int attempt = 0; (rc = ::mdb_env_set_mapsize (_env.get(), bytes)) == EINVAL && attempt < 1000; ++attempt)
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    if (rc) throw MdbEx (std::string ("mdb_env_set_mapsize: ") + ::mdb_strerror (rc), rc);
+  }
+ public:
+  /** Sets the size of the memory map, waiting for the transactions of this process to finish.
+   * Throws `MdbEx` with `EDEADLK` if the current thread has a transaction open. */
+  void setMapSize (size_t bytes) {
+    MapGrowth::Resizing resizing (*_growth, EDEADLK);
+    resizeMap (bytes);
+  }
+  /** Adopts the map size set by another process, on `MDB_MAP_RESIZED` from `mdb_txn_begin` or `mdb_txn_renew`.
+   * Throws `MdbEx` with `MDB_MAP_RESIZED` if the current thread has a transaction open. */
+  void adoptMapSize() {
+    MapGrowth::Resizing resizing (*_growth, MDB_MAP_RESIZED);
+    resizeMap (0);
+  }
+  /** Grows the map by the `MapGrowth::_factor` (see `setMapGrowth`), unless another thread has grown it past the `seenSize` already.
+   * Throws `MdbEx` with `MDB_MAP_FULL` if the map has reached the `MapGrowth::_maxBytes` or if the current thread has a transaction open. */
+  void growMap (size_t seenSize) {
+    MapGrowth& growth = *_growth;
+    MapGrowth::Resizing resizing (growth, MDB_MAP_FULL);
+    MDB_envinfo info; int rc = ::mdb_env_info (_env.get(), &info);
+    if (rc) throw MdbEx (std::string ("mdb_env_info: ") + ::mdb_strerror (rc), rc);
+    if (info.me_mapsize > seenSize) return;
+    const size_t maxBytes = growth._maxBytes;
+    if (maxBytes && info.me_mapsize >= maxBytes) throw MdbEx ("growMap: the map has reached its maximum size", MDB_MAP_FULL);
+    MDB_stat st; rc = ::mdb_env_stat (_env.get(), &st);
+    if (rc) throw MdbEx (std::string ("mdb_env_stat: ") + ::mdb_strerror (rc), rc);
+    const size_t page = st.ms_psize ? st.ms_psize : 4096;
+    size_t bytes = std::max ((size_t) (info.me_mapsize * growth._factor.load()), info.me_mapsize + page);
+    bytes = (bytes + page - 1) / page * page;
+    if (maxBytes && bytes > maxBytes) bytes = maxBytes;
+    resizeMap (bytes);
+    ++growth._growths;
+  }
+  /** Grows the map in advance if less than `bytes` of it are free.
+   * For the transactions which can't be retried on `MDB_MAP_FULL`, such as the `BulkLoader`'s. */
+  void reserveRoom (size_t bytes) {
+    for (;;) {
+      MapStats stats (mapStats());
+      if (stats.freePages() * stats._pageSize >= bytes) return;
+      const size_t maxBytes = _growth->_maxBytes;
+      if (maxBytes && stats._mapSize >= maxBytes) return;
+      growMap (stats._mapSize);
+    }
+  }
+
+  /** Runs `fun (Transaction&)` in a write transaction and commits it.\n
+   * If the transaction fails with `MDB_MAP_FULL` then it is aborted, the map is grown (see `growMap`) and `fun` is invoked again in a new transaction,
+   * hence `fun` should have no side effects outside of the database.\n
+   * The `add`, `erase` and the other methods without the `txn` parameter write this way.
+   * @return What `fun` returns. */
+  template <typename Fun> auto write (Fun fun) -> decltype (fun (std::declval<Transaction&>())) {
+    typedef decltype (fun (std::declval<Transaction&>())) R;
+    for (;;) {
+      size_t mapSize = 0;
+      try {
+        Transaction txn (beginTransaction());
+        MDB_envinfo info; int rc = ::mdb_env_info (_env.get(), &info);
+        if (rc) throw MdbEx (std::string ("mdb_env_info: ") + ::mdb_strerror (rc), rc);
+        mapSize = info.me_mapsize;
+        MdbWriterResult<R> result;
+        result.apply (fun, txn);
+        commitTransaction (txn);
+        return result.take();
+      } catch (const MdbEx& ex) {
+        if (ex._rc != MDB_MAP_FULL) throw;
+      }
+      growMap (mapSize);
+    }
   }
 
   template <typename K, typename V> void add (const K& key, const V& value, Transaction& txn) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
 
     char vbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring vbytes (sizeof (vbuf), vbuf, false, 0);
-    mdbSerialize (vbytes, value);
+    valueBytes (vbytes, value);
     MDB_val mvalue = {vbytes.size(), (void*) vbytes.data()};
 
-    for (auto& trigger: _triggers) trigger.second->add (*this, (void*) &key, kbytes, (void*) &value, vbytes, txn);
+    triggerAdd ((void*) &key, kbytes, (void*) &value, vbytes, txn);
 
     int rc = ::mdb_put (txn.get(), _dbi, &mkey, &mvalue, 0);
-    if (rc) throw MdbEx (std::string ("mdb_put: ") + ::strerror (rc));
+    if (rc) throw MdbEx (std::string ("mdb_put: ") + ::mdb_strerror (rc), rc);
   }
   template <typename K, typename V> void add (const K& key, const V& value) {
-    Transaction txn (beginTransaction());
-    add (key, value, txn);
-    commitTransaction (txn);
+    write ([&] (Transaction& txn) {add (key, value, txn);});
+  }
+
+  /** Adds a value of `size` bytes which `writer (char* data, size_t size)` writes directly into the memory map (`MDB_RESERVE`),
+   * saving on the intermediate buffer and the copying of large values.\n
+   * `MDB_RESERVE` isn't supported for `MDB_DUPSORT` databases, and the triggers need the value before it is stored,
+   * in these cases the value is written into a temporary buffer and added as usual. */
+  template <typename K, typename Writer> void addReserved (const K& key, size_t size, Writer writer, Transaction& txn) {
+    char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+    gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    keyBytes (kbytes, key);
+    putReserved (kbytes, (void*) &key, nullptr, size, writer, txn);
+  }
+  template <typename K, typename Writer> void addReserved (const K& key, size_t size, Writer writer) {
+    write ([&] (Transaction& txn) {addReserved (key, size, writer, txn);});
   }
 
+  /** Like `add` but serializes the `value` straight into the memory map (see `addReserved`).\n
+   * Pays for that with an extra serialization pass measuring the value (see `mdbSerializedSize`). */
+  template <typename K, typename V> void emplace (const K& key, const V& value, Transaction& txn) {
+    if (_dbFlags & MDB_INTEGERDUP) {add (key, value, txn); return;} // MDB_DUPSORT, no MDB_RESERVE anyway.
+    char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+    gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    keyBytes (kbytes, key);
+    putReserved (kbytes, (void*) &key, (void*) &value, mdbSerializedSize (value),
+      [&value] (char* data, size_t size) {mdbSerializeInto (data, size, value);}, txn);
+  }
+  template <typename K, typename V> void emplace (const K& key, const V& value) {
+    write ([&] (Transaction& txn) {emplace (key, value, txn);});
+  }
+
+ protected:
+  template <typename Writer> void putReserved (gstring& kbytes, void* key, void* value, size_t size, Writer writer, Transaction& txn) {
+    MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
+    if ((_dbFlags & MDB_DUPSORT) || !_triggers.empty()) {
+      char vbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+      gstring vbytes (sizeof (vbuf), vbuf, false, 0);
+      vbytes.reserve (size + 1);
+      writer (vbytes.data(), size);
+      vbytes.length (size);
+      MDB_val mvalue = {vbytes.size(), (void*) vbytes.data()};
+      triggerAdd (key, kbytes, value, vbytes, txn);
+      int rc = ::mdb_put (txn.get(), _dbi, &mkey, &mvalue, 0);
+      if (rc) throw MdbEx (std::string ("mdb_put: ") + ::mdb_strerror (rc), rc);
+      return;
+    }
+    MDB_val mvalue = {size, nullptr};
+    int rc = ::mdb_put (txn.get(), _dbi, &mkey, &mvalue, MDB_RESERVE);
+    if (rc) throw MdbEx (std::string ("mdb_put: ") + ::mdb_strerror (rc), rc);
+    writer ((char*) mvalue.mv_data, size);
+  }
+ public:
+
+  /** Loads a large number of records, appending them to the B-tree (`MDB_APPEND`, `MDB_APPENDDUP`) instead of descending it for every record.\n
+   * Records going before the last key already in the database are put as usual.\n
+   * The records must come in the database order: either `presorted` by the caller (the loader throws `MdbEx` on a record out of order)
+   * or sorted by the loader with an `ExternalSort` first, which assumes the default bytewise order of the keys.\n
+   * The records are written in transactions of about `_txnBytes` bytes. A presorted loader keeps the write transaction open between the `add`s.\n
+   * These transactions aren't retried on `MDB_MAP_FULL`, instead the map is grown in advance to have twice the `_txnBytes` free (see `reserveRoom`).\n
+   * The triggers are invoked with `nullptr` for the key and the value objects (the serialized bytes are there).\n
+   * In a non-`MDB_DUPSORT` database the last value of a key wins, in `MDB_DUPSORT` the duplicate values are skipped.
+   * Example: \code
+   *   auto loader (mdb.bulkLoader (false));
+   *   for (auto& en: input) loader.add (en.first, en.second);
+   *   loader.finish();
+   * \endcode */
+  struct BulkLoader {
+    Mdb* _mdb;
+    bool _presorted;
+    std::unique_ptr<ExternalSort> _sort;
+    size_t _txnBytes;
+    /// Invoked after every transaction is committed with the number of records and bytes written so far.
+    std::function<void(uint64_t records, uint64_t bytes)> _progress;
+    Transaction _txn {nullptr, ::mdb_txn_abort};
+    std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> _cur {nullptr, ::mdb_cursor_close};
+    gstring _lastKey, _lastValue; bool _haveLast = false;
+    gstring _tailKey; ///< The last key of the database before the load.
+    bool _appending = false; ///< Whether we're past the `_tailKey`, appending to the B-tree.
+    size_t _pending = 0; uint64_t _records = 0, _bytes = 0;
+
+    BulkLoader (Mdb* mdb, bool presorted, size_t memoryLimit, size_t txnBytes, std::string tmpDir):
+      _mdb (mdb), _presorted (presorted), _txnBytes (txnBytes) {
+      if (presorted) return;
+      if (mdb->_dbFlags & (MDB_INTEGERKEY | MDB_REVERSEKEY | MDB_INTEGERDUP | MDB_REVERSEDUP))
+        throw MdbEx ("BulkLoader: ExternalSort only knows the bytewise order, the records should be presorted");
+      _sort.reset (new ExternalSort (memoryLimit, tmpDir, mdb->_dbFlags & MDB_DUPSORT));
+    }
+    BulkLoader (BulkLoader&&) = default;
+
+    template <typename K, typename V> void add (const K& key, const V& value) {
+      char kbuf[64]; gstring kbytes (sizeof (kbuf), kbuf, false, 0); _mdb->keyBytes (kbytes, key);
+      char vbuf[64]; gstring vbytes (sizeof (vbuf), vbuf, false, 0); _mdb->valueBytes (vbytes, value);
+      if (_sort) _sort->add (kbytes, vbytes); else append (kbytes, vbytes);
+    }
+
+   protected:
+    void commit() {
+      if (!_txn) return;
+      _cur.reset();
+      _mdb->commitTransaction (_txn);
+      _pending = 0;
+      if (_progress) _progress (_records, _bytes);
+    }
+    void append (gstring& kbytes, gstring& vbytes) {
+      const bool dup = _mdb->_dbFlags & MDB_DUPSORT;
+      const bool sameKey = _haveLast && kbytes == _lastKey;
+      if (sameKey && dup && vbytes == _lastValue) return; // MDB_DUPSORT doesn't keep duplicate duplicates.
+      if (!_txn) {
+        _mdb->reserveRoom (_txnBytes * 2);
+        _txn = _mdb->beginTransaction();
+        MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (_txn.get(), _mdb->_dbi, &cur);
+        if (rc) throw MdbEx (std::string ("BulkLoader, mdb_cursor_open: ") + ::mdb_strerror (rc));
+        _cur.reset (cur);
+        if (!_appending) {
+          MDB_val tkey, tvalue; rc = ::mdb_cursor_get (cur, &tkey, &tvalue, ::MDB_LAST);
+          if (rc == MDB_NOTFOUND) _appending = true;
+          else if (rc) throw MdbEx (std::string ("BulkLoader, mdb_cursor_get: ") + ::mdb_strerror (rc));
+          else _tailKey.clear().append ((const char*) tkey.mv_data, tkey.mv_size);
+        }
+      }
+      MDB_val mkey = {kbytes.size(), (void*) kbytes.data()}, mvalue = {vbytes.size(), (void*) vbytes.data()};
+      if (_haveLast) {
+        MDB_val last = {_lastKey.size(), (void*) _lastKey.data()}, lastValue = {_lastValue.size(), (void*) _lastValue.data()};
+        if (sameKey ? dup && ::mdb_dcmp (_txn.get(), _mdb->_dbi, &mvalue, &lastValue) < 0 : ::mdb_cmp (_txn.get(), _mdb->_dbi, &mkey, &last) < 0)
+          throw MdbEx ("BulkLoader: the records are not sorted");
+      }
+      if (!_appending && !sameKey) {
+        MDB_val tail = {_tailKey.size(), (void*) _tailKey.data()};
+        _appending = ::mdb_cmp (_txn.get(), _mdb->_dbi, &mkey, &tail) > 0;
+      }
+      _mdb->triggerAdd (nullptr, kbytes, nullptr, vbytes, _txn);
+      // Records going before the existing data of the database are put as usual.
+      const unsigned flags = !_appending ? 0 : !sameKey ? MDB_APPEND : (dup ? MDB_APPENDDUP : MDB_CURRENT);
+      int rc = ::mdb_cursor_put (_cur.get(), &mkey, &mvalue, flags);
+      if (rc == MDB_KEYEXIST) throw MdbEx ("BulkLoader: the records are not sorted");
+      if (rc) throw MdbEx (std::string ("BulkLoader, mdb_cursor_put: ") + ::mdb_strerror (rc), rc);
+      _lastKey.clear() << kbytes; _lastValue.clear() << vbytes; _haveLast = true;
+      ++_records; _bytes += kbytes.size() + vbytes.size();
+      _pending += kbytes.size() + vbytes.size();
+      if (_pending >= _txnBytes) commit();
+    }
+   public:
+
+    /** Writes the remaining records and commits.
+     * @return The number of records written. */
+    uint64_t finish() {
+      if (_sort) _sort->merge ([this] (const gstring& key, const gstring& value) {
+        append (const_cast<gstring&> (key), const_cast<gstring&> (value));});
+      commit();
+      return _records;
+    }
+  };
+  /** Creates a `BulkLoader` for this database.
+   * @param presorted Whether the records are added in the database order already.
+   * @param memoryLimit How much of the records to keep in memory before spilling them to disk (when not `presorted`).
+   * @param txnBytes The amount of data to write in a single transaction.
+   * @param tmpDir Where to keep the sorted runs. */
+  BulkLoader bulkLoader (bool presorted, size_t memoryLimit = 256 * 1024 * 1024, size_t txnBytes = 64 * 1024 * 1024, std::string tmpDir = "/tmp") {
+    return BulkLoader (this, presorted, memoryLimit, txnBytes, tmpDir);
+  }
+
+  /** Applies the mutations submitted from many threads on a single background thread, many mutations per write transaction.\n
+   * Saves on the writers queuing for the environment lock and on the per-transaction commit (and sync) costs.\n
+   * A future returned by `submit` becomes ready when the transaction with the mutation is committed.
+   * If a mutation throws then its batch is aborted and the mutations of the batch are retried one transaction each,
+   * hence the mutation might be invoked more than once (but is only committed once) and should have no side effects outside of the database.\n
+   * The `Mdb` must outlive the `Writer`. The mutations still queued are applied when the `Writer` is stopped or destroyed.
+   * Example: \code
+   *   Mdb::Writer writer (mdb);
+   *   std::future<void> added = writer.add (key, value);
+   *   std::future<int> count = writer.submit ([](Mdb& mdb, Mdb::Transaction& txn) {...; return 1;});
+   *   added.get();
+   * \endcode */
+  struct Writer: boost::noncopyable {
+    struct Job {
+      std::function<void(Mdb&, Transaction&)> _apply; ///< Applies the mutation, keeping the result.
+      std::function<void()> _committed; ///< Passes the result to the future.
+      std::function<void(std::exception_ptr)> _failed;
+    };
+    Mdb* _mdb;
+    uint32_t _maxBatch;
+    std::mutex _mutex; std::condition_variable _cond; ///< Guard and signal the `_queue`.
+    std::deque<Job> _queue;
+    bool _stop = false;
+    std::atomic<uint64_t> _transactions {0}, _mutations {0};
+    std::thread _thread;
+
+    /** @param maxBatch The maximum number of mutations in a single transaction. */
+    Writer (Mdb& mdb, uint32_t maxBatch = 1024): _mdb (&mdb), _maxBatch (std::max (maxBatch, 1u)) {
+      _thread = std::thread (&Writer::loop, this);
+    }
+
+    /** Queues the `mutation (Mdb&, Transaction&)` for the background thread.
+     * @return The future of the `mutation` result, ready after the commit. */
+    template <typename Fun> auto submit (Fun mutation) -> std::future<decltype (mutation (std::declval<Mdb&>(), std::declval<Transaction&>()))> {
+      typedef decltype (mutation (std::declval<Mdb&>(), std::declval<Transaction&>())) R;
+      auto promise = std::make_shared<std::promise<R>>();
+      auto result = std::make_shared<MdbWriterResult<R>>();
+      Job job;
+      job._apply = [mutation,result] (Mdb& mdb, Transaction& txn) mutable {result->apply (mutation, mdb, txn);};
+      job._committed = [promise,result]() {result->fulfil (*promise);};
+      job._failed = [promise] (std::exception_ptr ex) {promise->set_exception (ex);};
+      std::future<R> future (promise->get_future());
+      {std::lock_guard<std::mutex> lock (_mutex);
+        if (_stop) throw MdbEx ("Writer: stopped");
+        _queue.push_back (std::move (job));}
+      _cond.notify_one();
+      return future;
+    }
+    template <typename K, typename V> std::future<void> add (const K& key, const V& value) {
+      return submit ([key,value] (Mdb& mdb, Transaction& txn) {mdb.add (key, value, txn);});}
+    template <typename K, typename V> std::future<bool> eraseKV (const K& key, const V& value) {
+      return submit ([key,value] (Mdb& mdb, Transaction& txn) {return mdb.eraseKV (key, value, txn);});}
+    template <typename K> std::future<bool> erase (const K& key) {
+      return submit ([key] (Mdb& mdb, Transaction& txn) {return mdb.erase (key, txn);});}
+
+   protected:
+    /** Applies the `jobs` in a single transaction (growing the map if necessary, see `Mdb::write`),
+     * returning `false` if a mutation or the commit failed. */
+    bool apply (std::vector<Job>& jobs, size_t from, size_t till) {
+      try {
+        _mdb->write ([&] (Transaction& txn) {for (size_t num = from; num < till; ++num) jobs[num]._apply (*_mdb, txn);});
+      } catch (...) {
+        if (till - from == 1) jobs[from]._failed (std::current_exception());
+        return false;
+      }
+      ++_transactions; _mutations += till - from;
+      for (size_t num = from; num < till; ++num) jobs[num]._committed();
+      return true;
+    }
+    void loop() {
+      std::vector<Job> jobs;
+      for (;;) {
+        {std::unique_lock<std::mutex> lock (_mutex);
+          _cond.wait (lock, [this]() {return _stop || !_queue.empty();});
+          if (_queue.empty()) return; // Stopped and drained.
+          jobs.clear();
+          while (!_queue.empty() && jobs.size() < _maxBatch) {jobs.push_back (std::move (_queue.front())); _queue.pop_front();}}
+        if (!apply (jobs, 0, jobs.size()) && jobs.size() > 1)
+          for (size_t num = 0; num < jobs.size(); ++num) apply (jobs, num, num + 1); // Isolate the failing mutation.
+      }
+    }
+   public:
+
+    /** Applies the queued mutations and stops the background thread. */
+    void stop() {
+      {std::lock_guard<std::mutex> lock (_mutex); _stop = true;}
+      _cond.notify_all();
+      if (_thread.joinable()) _thread.join();
+    }
+    ~Writer() {stop();}
+  };
+
   template <typename K, typename V> bool first (const K& key, V& value, Transaction& txn) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
     MDB_val mvalue;
     int rc = ::mdb_get (txn.get(), _dbi, &mkey, &mvalue);
     if (rc == MDB_NOTFOUND) return false;
     if (rc) throw MdbEx (std::string ("mdb_get: ") + ::strerror (rc));
     gstring vstr (0, mvalue.mv_data, false, mvalue.mv_size);
-    mdbDeserialize (vstr, value);
+    valueFrom (vstr, value);
     return true;
   }
   template <typename K, typename V> bool first (const K& key, V& value) {
-    Transaction txn (beginTransaction (MDB_RDONLY));
-    bool rb = first (key, value, txn);
-    commitTransaction (txn);
-    return rb;
+    ReadTransaction txn (*this);
+    return first (key, value, txn._txn);
   }
 
   /** Iterate over `key` values until `visitor` returns `false`. Return the number of values visited. */
   template <typename K, typename V> int32_t all (const K& key, std::function<bool(const V&)> visitor, Transaction& txn) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
 
     MDB_cursor* cur = 0; int rc = ::mdb_cursor_open (txn.get(), _dbi, &cur);
@@ -298,7 +1219,7 @@ struct Mdb {
 
     V value;
     gstring vstr (0, mval.mv_data, false, mval.mv_size);
-    mdbDeserialize (vstr, value);
+    valueFrom (vstr, value);
     bool goOn = visitor (value);
     int32_t count = 1;
 
@@ -306,7 +1227,7 @@ struct Mdb {
       rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_NEXT_DUP); if (rc == MDB_NOTFOUND) return count;
       if (rc) throw MdbEx (std::string ("mdb_cursor_get: ") + ::strerror (rc));
       gstring vstr (0, mval.mv_data, false, mval.mv_size);
-      mdbDeserialize (vstr, value);
+      valueFrom (vstr, value);
       goOn = visitor (value);
       ++count;
     }
@@ -314,61 +1235,261 @@ struct Mdb {
   }
   /** Iterate over `key` values until `visitor` returns `false`. Return the number of values visited. */
   template <typename K, typename V> int32_t all (const K& key, std::function<bool(const V&)> visitor) {
-    Transaction txn (beginTransaction (MDB_RDONLY));
-    int32_t count = all (key, visitor, txn);
-    commitTransaction (txn);
+    ReadTransaction txn (*this);
+    return all (key, visitor, txn._txn);
+  }
+
+  /** Adds a fixed-size value as is, without the serialization.\n
+   * Meant for the `MDB_DUPFIXED` databases (of posting lists and such) which are read with `allFixed`.
+   * With `MDB_INTEGERDUP` the `unsigned` and `size_t` values are kept in the numeric order. */
+  template <typename K, typename V> void addFixed (const K& key, const V& value, Transaction& txn) {
+    static_assert (std::is_trivially_copyable<V>::value, "addFixed: the value must be trivially copyable");
+    char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+    gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    keyBytes (kbytes, key);
+    MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
+    gstring vbytes (0, (void*) &value, false, sizeof (V));
+    MDB_val mvalue = {sizeof (V), (void*) &value};
+
+    triggerAdd ((void*) &key, kbytes, (void*) &value, vbytes, txn);
+
+    int rc = ::mdb_put (txn.get(), _dbi, &mkey, &mvalue, 0);
+    if (rc) throw MdbEx (std::string ("mdb_put: ") + ::mdb_strerror (rc), rc);
+  }
+  template <typename K, typename V> void addFixed (const K& key, const V& value) {
+    write ([&] (Transaction& txn) {addFixed (key, value, txn);});
+  }
+
+  /** Reads the `key` values added with `addFixed` in batches (`MDB_GET_MULTIPLE`, `MDB_NEXT_MULTIPLE`),
+   * passing them to `visitor (const V* values, size_t count)` until it returns `false`.\n
+   * The `values` point straight into the memory map, unless the page isn't aligned for `V`, then they are copied.
+   * They should not be used after the `visitor` returns.\n
+   * Requires `MDB_DUPFIXED` (see the `flags` of the constructor).
+   * @return The number of values visited. */
+  template <typename K, typename V, typename Visitor> size_t allFixed (const K& key, Visitor visitor, Transaction& txn) {
+    static_assert (std::is_trivially_copyable<V>::value, "allFixed: the value must be trivially copyable");
+    if (!(_dbFlags & MDB_DUPFIXED)) throw MdbEx ("allFixed: not an MDB_DUPFIXED database");
+    char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+    gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    keyBytes (kbytes, key);
+    MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
+
+    MDB_cursor* cur = 0; int rc = ::mdb_cursor_open (txn.get(), _dbi, &cur);
+    if (rc) throw MdbEx (std::string ("mdb_cursor_open: ") + ::strerror (rc));
+    std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+    MDB_val mval = {0, 0};
+    rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_SET_KEY); if (rc == MDB_NOTFOUND) return 0;
+    if (rc) throw MdbEx (std::string ("mdb_cursor_get: ") + ::strerror (rc));
+    rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_GET_MULTIPLE);
+    std::vector<V> aligned;
+    size_t count = 0;
+    while (rc == 0) {
+      if (mval.mv_size % sizeof (V)) throw MdbEx ("allFixed: the values are not of the size of V");
+      const size_t batch = mval.mv_size / sizeof (V);
+      const V* values = (const V*) mval.mv_data;
+      if ((uintptr_t) mval.mv_data % alignof (V)) {
+        aligned.resize (batch); ::memcpy (aligned.data(), mval.mv_data, mval.mv_size); values = aligned.data();}
+      count += batch;
+      if (!visitor (values, batch)) return count;
+      rc = ::mdb_cursor_get (cur, &mkey, &mval, ::MDB_NEXT_MULTIPLE);
+    }
+    if (rc != MDB_NOTFOUND) throw MdbEx (std::string ("mdb_cursor_get: ") + ::strerror (rc));
     return count;
   }
+  template <typename K, typename V, typename Visitor> size_t allFixed (const K& key, Visitor visitor) {
+    ReadTransaction txn (*this);
+    return allFixed<K, V> (key, visitor, txn._txn);
+  }
 
   template <typename K, typename V> bool eraseKV (const K& key, const V& value, Transaction& txn) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     if (kbytes.empty()) throw MdbEx ("eraseKV: key is empty");
     MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
 
     char vbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring vbytes (sizeof (vbuf), vbuf, false, 0);
-    mdbSerialize (vbytes, value);
+    valueBytes (vbytes, value);
     MDB_val mvalue = {vbytes.size(), (void*) vbytes.data()};
 
-    for (auto& trigger: _triggers) trigger.second->eraseKV (*this, (void*) &key, kbytes, (void*) &value, vbytes, txn);
+    triggerEraseKV ((void*) &key, kbytes, (void*) &value, vbytes, txn);
 
     int rc = ::mdb_del (txn.get(), _dbi, &mkey, &mvalue);
     if (rc == MDB_NOTFOUND) return false;
-    if (rc) throw MdbEx (std::string ("mdb_del: ") + ::strerror (rc));
+    if (rc) throw MdbEx (std::string ("mdb_del: ") + ::mdb_strerror (rc), rc);
     return true;
   }
   template <typename K, typename V> bool eraseKV (const K& key, const V& value) {
-    Transaction txn (beginTransaction());
-    bool rb = eraseKV (key, value, txn);
-    commitTransaction (txn);
-    return rb;
+    return write ([&] (Transaction& txn) {return eraseKV (key, value, txn);});
   }
 
   /** Erase all values of the `key`. */
   template <typename K> bool erase (const K& key, Transaction& txn) {
     char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
     gstring kbytes (sizeof (kbuf), kbuf, false, 0);
-    mdbSerialize (kbytes, key);
+    keyBytes (kbytes, key);
     if (kbytes.empty()) throw MdbEx ("erase: key is empty");
     MDB_val mkey = {kbytes.size(), (void*) kbytes.data()};
 
-    for (auto& trigger: _triggers) trigger.second->erase (*this, (void*) &key, kbytes, txn);
+    triggerErase ((void*) &key, kbytes, txn);
 
     int rc = ::mdb_del (txn.get(), _dbi, &mkey, nullptr);
     if (rc == MDB_NOTFOUND) return false;
-    if (rc) throw MdbEx (std::string ("mdb_del: ") + ::strerror (rc));
+    if (rc) throw MdbEx (std::string ("mdb_del: ") + ::mdb_strerror (rc), rc);
     return true;
   }
   /** Erase all values of the `key`. */
   template <typename K> bool erase (const K& key) {
-    Transaction txn (beginTransaction());
-    bool rb = erase (key, txn);
-    commitTransaction (txn);
-    return rb;
+    return write ([&] (Transaction& txn) {return erase (key, txn);});
   }
 
+ protected:
+  /** `parts - 1` keys evenly splitting the range between the `first` and the `last` key, assuming the keys are spread uniformly.\n
+   * Interpolates up to eight bytes after the common prefix. The bytes are reversed for the `MDB_REVERSEKEY` order
+   * and for the `MDB_INTEGERKEY` order on a little-endian machine. */
+  std::vector<std::string> interpolateKeys (const MDB_val& first, const MDB_val& last, uint32_t parts) const {
+    const bool reverse = (_dbFlags & MDB_REVERSEKEY) || ((_dbFlags & MDB_INTEGERKEY) && htonl (1) != 1);
+    std::string from ((const char*) first.mv_data, first.mv_size), till ((const char*) last.mv_data, last.mv_size);
+    if (reverse) {std::reverse (from.begin(), from.end()); std::reverse (till.begin(), till.end());}
+    size_t prefix = 0; while (prefix < from.size() && prefix < till.size() && from[prefix] == till[prefix]) ++prefix;
+    const size_t width = std::min ((size_t) 8, std::max (from.size(), till.size()) - prefix);
+    auto number = [prefix,width] (const std::string& key) {
+      uint64_t num = 0;
+      for (size_t pos = prefix; pos < prefix + width; ++pos) num = (num << 8) | (pos < key.size() ? (uint8_t) key[pos] : 0);
+      return num;};
+    const uint64_t low = number (from), high = number (till);
+    std::vector<std::string> splits;
+    if (high <= low) return splits;
+    for (uint32_t part = 1; part < parts; ++part) {
+      uint64_t num = low + (uint64_t) ((long double) (high - low) * part / parts);
+      std::string split (from, 0, prefix); split.resize (prefix + width);
+      for (size_t pos = prefix + width; pos-- > prefix; num >>= 8) split[pos] = (char) (num & 0xFF);
+      if (reverse) std::reverse (split.begin(), split.end());
+      if (splits.empty() || splits.back() != split) splits.push_back (split);
+    }
+    return splits;
+  }
+  /** Cuts the [`first`, `last`] keys of the database into about `parts` chunks, returning the keys in between.\n
+   * The keys interpolated between the `first` and the `last` (see `interpolateKeys`) are looked up with the `cur`sor
+   * and the gaps between the keys found are interpolated again. The second pass finds the dense parts of the key space
+   * that the first one misses when the keys start with a varying prefix, such as the length of the boost-serialized strings. */
+  std::vector<std::string> splitKeys (MDB_cursor* cur, const MDB_val& first, const MDB_val& last, uint32_t parts) const {
+    MDB_txn* txn = ::mdb_cursor_txn (cur);
+    std::vector<std::string> found; // The existing keys following the interpolated ones, ascending, past the `first`.
+    for (const std::string& split: interpolateKeys (first, last, parts)) {
+      MDB_val key = {split.size(), (void*) split.data()}, val;
+      int rc = ::mdb_cursor_get (cur, &key, &val, ::MDB_SET_RANGE);
+      if (rc == MDB_NOTFOUND) break;
+      if (rc) throw MdbEx (std::string ("splitKeys, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+      if (::mdb_cmp (txn, _dbi, &key, &first) <= 0 || ::mdb_cmp (txn, _dbi, &key, &last) >= 0) continue;
+      if (found.empty() || found.back().size() != key.mv_size || ::memcmp (found.back().data(), key.mv_data, key.mv_size))
+        found.push_back (std::string ((const char*) key.mv_data, key.mv_size));
+    }
+    const uint32_t gapParts = std::max (parts / (uint32_t) (found.size() + 1), 1u);
+    std::vector<std::string> splits;
+    MDB_val from = first;
+    for (size_t gap = 0; gap <= found.size(); ++gap) {
+      MDB_val till = gap < found.size() ? MDB_val {found[gap].size(), (void*) found[gap].data()} : last;
+      if (gapParts > 1) for (std::string& split: interpolateKeys (from, till, gapParts)) {
+        MDB_val key = {split.size(), (void*) split.data()};
+        if (::mdb_cmp (txn, _dbi, &key, &from) > 0 && ::mdb_cmp (txn, _dbi, &key, &till) < 0) splits.push_back (std::move (split));
+      }
+      if (gap < found.size()) splits.push_back (found[gap]);
+      from = till;
+    }
+    return splits;
+  }
+ public:
+
+  /** Scans the database with `threads` threads (`hardware_concurrency` by default), all of them reading the same snapshot.\n
+   * The key space is cut into chunks, eight per thread, by interpolating between the existing keys (see `splitKeys`);
+   * the threads pick the chunks as they go, which evens out the skewed key spaces somewhat.\n
+   * Every chunk starts with a copy of the `identity`. `visitor (Acc&, const IteratorEntry&)` folds the chunk's records into it, returning `false` to stop the scan.
+   * Then `reducer (Acc& into, Acc& chunk)` combines the chunks into `init` in the key order (thus `init` is counted once).
+   * The `visitor` is invoked concurrently from the scanning threads.\n
+   * The read transactions are begun on the calling thread and handed over to the scanning threads, relying on `MDB_NOTLS` (see `envFlags`).
+   * The ones behind the latest `mdb_txn_id` are renewed a few times, then all of them are renewed with the commits blocked by a write transaction.\n
+   * An exception thrown by the visitor stops the scan and is rethrown.
+   * Example: \code
+   *   size_t bytes = mdb.parallelScan ((size_t) 0, (size_t) 0, [](size_t& sum, const Mdb::IteratorEntry& en) {sum += en._val.mv_size; return true;},
+   *     [](size_t& into, size_t& chunk) {into += chunk;});
+   * \endcode
+   * @param identity The neutral element of the `reducer` (zero for a sum, the largest value for a minimum). */
+  template <typename Acc, typename Visitor, typename Reducer>
+  Acc parallelScan (Acc init, const Acc& identity, Visitor visitor, Reducer reducer, uint32_t threads = 0) {
+    if (!threads) threads = std::max (std::thread::hardware_concurrency(), 1u);
+    std::vector<Transaction> txns; // These hold the map growth off, so do the scanning threads (a growth from the visitor throws).
+    for (uint32_t num = 0; num < threads; ++num) txns.push_back (beginTransaction (MDB_RDONLY));
+    auto renew = [] (Transaction& txn) {
+      ::mdb_txn_reset (txn.get());
+      int rc = ::mdb_txn_renew (txn.get());
+      if (rc) throw MdbEx (std::string ("parallelScan, mdb_txn_renew: ") + ::mdb_strerror (rc), rc);};
+    for (int attempt = 0;; ++attempt) { // Pin the transactions to the latest snapshot.
+      size_t latest = 0; for (auto& txn: txns) latest = std::max (latest, (size_t) ::mdb_txn_id (txn.get()));
+      bool pinned = true; for (auto& txn: txns) if ((size_t) ::mdb_txn_id (txn.get()) != latest) pinned = false;
+      if (pinned) break;
+      if (attempt < 3) {for (auto& txn: txns) if ((size_t) ::mdb_txn_id (txn.get()) != latest) renew (txn); continue;}
+      Transaction blocker (beginTransaction()); // Holds the writer lock: nothing is committed till it's aborted.
+      for (auto& txn: txns) renew (txn);
+      break;
+    }
+
+    std::vector<std::string> splits;
+    {MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txns[0].get(), _dbi, &cur);
+      if (rc) throw MdbEx (std::string ("parallelScan, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+      std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+      MDB_val first, last, val;
+      rc = ::mdb_cursor_get (cur, &first, &val, ::MDB_FIRST); if (rc == MDB_NOTFOUND) return init;
+      if (rc) throw MdbEx (std::string ("parallelScan, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+      rc = ::mdb_cursor_get (cur, &last, &val, ::MDB_LAST);
+      if (rc) throw MdbEx (std::string ("parallelScan, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+      splits = splitKeys (cur, first, last, threads * 8);}
+
+    const size_t chunks = splits.size() + 1;
+    std::vector<Acc> accs (chunks, identity);
+    std::atomic<size_t> nextChunk {0}; std::atomic<bool> stop {false};
+    std::vector<std::exception_ptr> errors (threads);
+    auto scan = [&] (uint32_t worker) {
+      try {
+        MapGrowth::Holding holding (*_growth, false); // Not waiting for a growth which waits for the `txns`.
+        MDB_txn* txn = txns[worker].get();
+        MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn, _dbi, &cur);
+        if (rc) throw MdbEx (std::string ("parallelScan, mdb_cursor_open: ") + ::mdb_strerror (rc), rc);
+        std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+        IteratorEntry entry; entry._dbFlags = _dbFlags;
+        for (size_t chunk; !stop && (chunk = nextChunk++) < chunks;) {
+          if (chunk == 0) rc = ::mdb_cursor_get (cur, &entry._key, &entry._val, ::MDB_FIRST);
+          else {entry._key = {splits[chunk - 1].size(), (void*) splits[chunk - 1].data()}; rc = ::mdb_cursor_get (cur, &entry._key, &entry._val, ::MDB_SET_RANGE);}
+          MDB_val limit = {0, nullptr}; if (chunk < splits.size()) limit = {splits[chunk].size(), (void*) splits[chunk].data()};
+          for (; rc == 0; rc = ::mdb_cursor_get (cur, &entry._key, &entry._val, ::MDB_NEXT)) {
+            if (limit.mv_data && ::mdb_cmp (txn, _dbi, &entry._key, &limit) >= 0) break;
+            if (stop.load (std::memory_order_relaxed) || !visitor (accs[chunk], (const IteratorEntry&) entry)) {stop = true; break;}
+          }
+          if (rc && rc != MDB_NOTFOUND) throw MdbEx (std::string ("parallelScan, mdb_cursor_get: ") + ::mdb_strerror (rc), rc);
+        }
+      } catch (...) {errors[worker] = std::current_exception(); stop = true;}
+    };
+    std::vector<std::thread> workers;
+    for (uint32_t worker = 1; worker < threads; ++worker) workers.emplace_back (scan, worker);
+    scan (0);
+    for (auto& thread: workers) thread.join();
+    for (auto& error: errors) if (error) std::rethrow_exception (error);
+    for (size_t chunk = 0; chunk < chunks; ++chunk) reducer (init, accs[chunk]);
+    return init;
+  }
+
+  /** A value which checks, while being serialized, that its bytes land straight at the `_place` (see `mdbSerializeInto`). */
+  struct PlacementProbe {
+    std::string _payload;
+    const char* _place = nullptr; size_t _size = 0;
+    bool _inPlace = false;
+    template <typename Archive> void serialize (Archive& ar, const unsigned int) {
+      ar & _payload;
+      _inPlace = _place && std::search (_place, _place + _size, _payload.begin(), _payload.end()) != _place + _size;
+    }
+  };
+
   static void test (Mdb& mdb) {
     mdb.add (std::string ("foo"), std::string ("bar"));
     // NB: "MDB_DUPSORT doesn't allow duplicate duplicates" (Howard Chu)
@@ -433,7 +1554,7 @@ struct Mdb {
         MDB_val mkey = {vbytes.size(), (void*) vbytes.data()};
         MDB_val mvalue = {kbytes.size(), (void*) kbytes.data()};
         int rc = ::mdb_put (txn.get(), _indexDb._dbi, &mkey, &mvalue, 0);
-        if (rc) throw MdbEx (std::string ("index, mdb_put: ") + ::strerror (rc));
+        if (rc) throw MdbEx (std::string ("index, mdb_put: ") + ::mdb_strerror (rc), rc);
       }
       void erase (Mdb& mdb, void* ekey, gstring& kbytes, Transaction& txn) {
         // Get all the values and remove them from the index.
@@ -486,14 +1607,331 @@ struct Mdb {
     if (indexDb.first (3, ik)) fail ("iv3");
     // Check the data.
     if (mdb.first (C2GSTRING ("ik"), ik)) fail ("ik");
+
+    // Asynchronous triggers.
+    mdb.setAsyncTriggers ("triggerLog", 16);
+    const uint64_t seq0 = mdb._asyncTriggers->lastSeq();
+    for (int num = 0; num < 100; ++num) mdb.add (C2GSTRING ("ak"), 1000 + num);
+    mdb.waitForIndexes();
+    if (!indexDb.first (1050, ik) || ik != "ak") fail ("!1050=ak");
+    TriggerLag lag = mdb.triggerLag();
+    if (lag._pending || lag._applied != 100 || lag._batches < 7) fail ("triggerLag");
+    if (mdb._asyncTriggers->lastSeq() != seq0 + 100) fail ("async sequence");
+    mdb.eraseKV (C2GSTRING ("ak"), 1000);
+    mdb.erase (C2GSTRING ("ak"));
+    mdb.waitForIndexes();
+    if (indexDb.first (1000, ik) || indexDb.first (1099, ik)) fail ("async erase");
+    if (mdb.triggerLag()._applied != 200) fail ("async erase changes");
+    mdb.stopAsyncTriggers();
+    mdb.setAsyncTriggers ("triggerLog", 16); // The sequence goes on from the last change applied, the log being empty.
+    if (mdb._asyncTriggers->_appliedSeq != seq0 + 200) fail ("async progress");
+    mdb.add (C2GSTRING ("ak"), 1200);
+    if (mdb._asyncTriggers->lastSeq() != seq0 + 201) fail ("async sequence restarted");
+    mdb.waitForIndexes();
+    if (!indexDb.first (1200, ik) || ik != "ak") fail ("!1200=ak");
+    mdb.erase (C2GSTRING ("ak"));
+    mdb.stopAsyncTriggers();
+    {std::unique_ptr<Mdb> owner (new Mdb (mdb)); owner->setAsyncTriggers ("triggerLog", 16);
+      Mdb copy (*owner); copy.add (C2GSTRING ("ak"), 1300);
+      owner->_dbi = 0; // Keeps the database handle open for the copy.
+      owner.reset(); // Stops the indexer, the copy going back to the synchronous triggers.
+      if (!indexDb.first (1300, ik) || ik != "ak") fail ("!1300=ak");
+      copy.add (C2GSTRING ("ak"), 1301); copy.waitForIndexes();
+      if (!indexDb.first (1301, ik) || ik != "ak") fail ("!1301=ak");
+      copy.erase (C2GSTRING ("ak"));
+      if (indexDb.first (1300, ik)) fail ("copy erase");}
+
+    // Cached read transactions.
+    MDB_txn* cached; {ReadTransaction txn (mdb); cached = txn._txn.get();}
+    {ReadTransaction txn (mdb); if (txn._txn.get() != cached) fail ("read transaction not reused");
+      ReadTransaction nested (mdb); if (nested._txn.get() != cached) fail ("nested read transaction not shared");}
+    mdb.setReadStaleness (60 * 1000 * 1000);
+    auto idleActive = [&mdb]() {
+      std::lock_guard<std::mutex> lock (mdb._readTxns->_mutex); int idle = 0;
+      for (auto& slot: mdb._readTxns->_slots) if (!slot.second._users && slot.second._active) ++idle;
+      return idle;};
+    {std::promise<void> read, checked; std::future<void> readFuture (read.get_future()), checkedFuture (checked.get_future());
+      std::thread reader ([&]() {int value; mdb.first (C2GSTRING ("rk"), value); read.set_value(); checkedFuture.wait();});
+      readFuture.wait();
+      if (idleActive() == 0) fail ("no idle reader kept active");
+      mdb.add (C2GSTRING ("rk"), 1);
+      if (idleActive() != 0) fail ("idle readers not reset on commit");
+      checked.set_value(); reader.join();}
+    {const size_t slots = mdb._readTxns->_slots.size();
+      for (int num = 0; num < 8; ++num) std::thread ([&mdb]() {int value; mdb.first (C2GSTRING ("rk"), value);}) .join();
+      if (mdb._readTxns->_slots.size() != slots) fail ("the transactions of the exited threads are kept");}
+    if (!mdb.first (C2GSTRING ("rk"), ti) || ti != 1) fail ("!rk=1");
+    mdb.add (C2GSTRING ("rk"), 2);
+    count = mdb.all<gstring, int> (C2GSTRING ("rk"), [&](const int& val) {
+      int first; if (!mdb.first (C2GSTRING ("rk"), first) || first != 1) fail ("nested first"); return true;});
+    if (count != 2) fail ("!rk=1,2"); // Sees the commit made through this Mdb despite the staleness allowance.
+    mdb.setReadStaleness (0);
+    mdb.erase (C2GSTRING ("rk"));
+    mdb.clearReadTransactions();
+
+    // Reserved writes.
+    Mdb blobs (mdb._env, "blobs", false);
+    blobs.addReserved (C2GSTRING ("blob"), 1000, [](char* data, size_t size) {::memset (data, 'b', size);});
+    if (!blobs.first (C2GSTRING ("blob"), tgs) || tgs.size() != 1000 || tgs[999] != 'b') fail ("!blob");
+    for (size_t len: {10, 62, 100, 1000, 4000}) {
+      PlacementProbe probe; probe._payload.assign (len, 'p'); probe._payload[0] = 'q';
+      const size_t size = mdbSerializedSize (probe);
+      std::unique_ptr<char[]> place (new char[size]); probe._place = place.get(); probe._size = size;
+      mdbSerializeInto (place.get(), size, probe);
+      if (!probe._inPlace) fail ("mdbSerializeInto went through a copy");
+    }
+    blobs.emplace (C2GSTRING ("str"), string ("emplaced"));
+    if (!blobs.first (C2GSTRING ("str"), ts) || ts != "emplaced") fail ("!str=emplaced");
+    blobs.emplace ((uint32_t) 1, C2GSTRING ("gs"));
+    if (!blobs.first ((uint32_t) 1, tgs) || tgs != "gs") fail ("!1=gs");
+    mdb.emplace (C2GSTRING ("ek"), 42); // MDB_DUPSORT, falls back to the buffer and runs the index trigger.
+    if (!mdb.first (C2GSTRING ("ek"), ti) || ti != 42) fail ("!ek=42");
+    if (!indexDb.first (42, ik) || ik != "ek") fail ("!42=ek");
+    mdb.erase (C2GSTRING ("ek"));
+
+    // Bulk loading.
+    {auto loader (blobs.bulkLoader (true, 0, 100));
+      for (uint32_t num = 10; num < 20; ++num) loader.add (num, (int) num);
+      loader.add ((uint32_t) 19, 190); // Last value wins.
+      bool thrown = false; try {loader.add ((uint32_t) 5, 5);} catch (const MdbEx&) {thrown = true;}
+      if (!thrown) fail ("BulkLoader accepted unsorted");
+      if (loader.finish() != 11) fail ("BulkLoader records");}
+    if (!blobs.first ((uint32_t) 19, ti) || ti != 190) fail ("!19=190");
+    {auto loader (mdb.bulkLoader (false, 64)); uint64_t commits = 0;
+      loader._txnBytes = 16; loader._progress = [&commits] (uint64_t, uint64_t) {++commits;};
+      for (int num = 99; num >= 0; --num) loader.add (C2GSTRING ("bk"), num);
+      loader.add (C2GSTRING ("bk"), 7); // Duplicate.
+      loader.add (C2GSTRING ("ak"), 1);
+      if (loader.finish() != 101) fail ("BulkLoader dup records");
+      if (commits < 2) fail ("BulkLoader commits");}
+    count = 0; sum = 0;
+    for (auto&& entry: mdb.valuesRange (C2GSTRING ("bk"))) {++count; sum += entry.getValue<int>();}
+    if (count != 100 || sum != 4950) fail ("bk values");
+    if (!indexDb.first (1, ik) || ik != "ak") fail ("!1=ak"); // The index trigger.
+    mdb.erase (C2GSTRING ("bk")); mdb.erase (C2GSTRING ("ak"));
+
+    // Fixed-size values.
+    Mdb postings (mdb._env, "postings", true, MDB_DUPFIXED | MDB_INTEGERDUP);
+    {Transaction txn (postings.beginTransaction());
+      for (uint32_t id = 3000; id > 0; --id) postings.addFixed (C2GSTRING ("term"), id, txn);
+      postings.addFixed (C2GSTRING ("other"), (uint32_t) 1, txn);
+      postings.commitTransaction (txn);}
+    uint64_t idSum = 0; uint32_t batches = 0, previous = 0; bool ordered = true;
+    size_t ids = postings.allFixed<gstring, uint32_t> (C2GSTRING ("term"), [&] (const uint32_t* values, size_t count) {
+      for (size_t num = 0; num < count; ++num) {ordered = ordered && values[num] > previous; previous = values[num]; idSum += values[num];}
+      ++batches; return true;});
+    if (ids != 3000 || idSum != 3000 * 3001 / 2) fail ("allFixed sum");
+    if (!ordered) fail ("allFixed order");
+    if (batches < 2) fail ("allFixed batches");
+    if (postings.allFixed<gstring, uint32_t> (C2GSTRING ("term"), [] (const uint32_t*, size_t) {return false;}) > 1024) fail ("allFixed stop");
+    if (postings.allFixed<gstring, uint32_t> (C2GSTRING ("none"), [] (const uint32_t*, size_t) {return true;}) != 0) fail ("allFixed none");
+
+    // Background writer.
+    {Writer writer (blobs);
+      std::promise<void> gate; std::shared_future<void> opened (gate.get_future());
+      writer.submit ([opened] (Mdb&, Transaction&) {opened.wait();}); // Let the mutations queue up.
+      std::vector<std::thread> threads; std::vector<std::future<void>> added[4];
+      for (int th = 0; th < 4; ++th) threads.emplace_back ([&writer,&added,th]() {
+        for (uint32_t num = 0; num < 250; ++num) added[th].push_back (writer.add ((uint32_t) (1000 + th * 250 + num), (int) num));});
+      for (auto& thread: threads) thread.join();
+      gate.set_value();
+      for (auto& futures: added) for (auto& future: futures) future.get();
+      if (writer._mutations != 1001) fail ("Writer mutations");
+      if (writer._transactions > 3) fail ("Writer batches");
+      auto good = writer.add ((uint32_t) 2000, 1);
+      auto bad = writer.submit ([] (Mdb&, Transaction&) -> int {throw MdbEx ("bad mutation");});
+      auto erased = writer.erase ((uint32_t) 1999);
+      good.get(); if (!erased.get()) fail ("Writer erase");
+      bool thrown = false; try {bad.get();} catch (const MdbEx&) {thrown = true;}
+      if (!thrown) fail ("Writer exception");}
+    if (!blobs.first ((uint32_t) 1500, ti) || ti != 0) fail ("!1500=0");
+    if (!blobs.first ((uint32_t) 2000, ti) || ti != 1) fail ("!2000=1");
+    if (blobs.first ((uint32_t) 1999, ti)) fail ("1999");
+
+    // Integer and reverse keys.
+    Mdb numeric (mdb._env, "ids", true, MDB_INTEGERKEY | MDB_DUPFIXED | MDB_INTEGERDUP);
+    for (uint32_t id: {256u, 1u, 65536u}) {numeric.add (id, id * 10u); numeric.add (id, id * 100u);}
+    std::vector<uint32_t> keys; std::vector<uint32_t> values;
+    for (auto&& entry: numeric) {keys.push_back (entry.getKey<uint32_t>()); values.push_back (entry.getValue<uint32_t>());}
+    if (keys != std::vector<uint32_t> ({1, 1, 256, 256, 65536, 65536})) fail ("INTEGERKEY order");
+    if (values != std::vector<uint32_t> ({10, 100, 2560, 25600, 655360, 6553600})) fail ("INTEGERDUP order");
+    uint32_t tu; if (!numeric.first (256u, tu) || tu != 2560) fail ("!256=2560");
+    bool thrown = false; try {numeric.add (-1, 1u);} catch (const MdbEx&) {thrown = true;}
+    if (!thrown) fail ("signed INTEGERKEY");
+    Mdb reversed (mdb._env, "reversed", false, MDB_REVERSEKEY);
+    reversed.add (C2GSTRING ("ab"), 1); reversed.add (C2GSTRING ("ba"), 2);
+    if (reversed.begin()->getKey<gstring>() != "ba") fail ("REVERSEKEY order");
+
+    // Memory map growth.
+    MapStats stats (mdb.mapStats());
+    if (!stats._pageSize || !stats._usedPages || stats._usedPages > stats._mapPages) fail ("mapStats");
+    const size_t tight = (stats._usedPages + 16) * stats._pageSize;
+    mdb.setMapSize (tight); mdb.setMapGrowth (1.5);
+    blobs.write ([&blobs] (Transaction& txn) {
+      for (uint32_t num = 0; num < 1000; ++num) blobs.addReserved (100000 + num, 1000, [](char* data, size_t size) {::memset (data, 'g', size);}, txn);});
+    const std::string blob (1000, 'w');
+    {Writer writer (blobs); std::vector<std::future<void>> added;
+      for (uint32_t num = 1000; num < 2000; ++num) added.push_back (writer.add (100000 + num, blob));
+      for (auto& future: added) future.get();}
+    MapStats grown (blobs.mapStats());
+    if (grown._mapSize <= tight || grown._growths < 2) fail ("map not grown");
+    if (!blobs.first (100500u, tgs) || tgs.size() != 1000 || tgs[0] != 'g') fail ("!100500");
+    if (!blobs.first (101500u, ts) || ts != blob) fail ("!101500");
+    thrown = false; // Growing the map from within a read of the same thread throws instead of waiting for the thread itself.
+    blobs.all (100500u, std::function<bool(const gstring&)> ([&] (const gstring&) {
+      try {blobs.write ([&] (Transaction& txn) {for (uint32_t num = 0; num < 4000; ++num) blobs.add (300000 + num, blob, txn);});
+      } catch (const MdbEx& ex) {thrown = ex._rc == MDB_MAP_FULL;}
+      return false;}));
+    if (!thrown || blobs.first (300000u, ts)) fail ("growth within a read");
+    thrown = false;
+    {ReadTransaction reading (blobs); try {blobs.setMapSize (grown._mapSize);} catch (const MdbEx& ex) {thrown = ex._rc == EDEADLK;}}
+    if (!thrown) fail ("setMapSize within a read");
+    mdb.setMapGrowth (1.5, grown._mapSize);
+    thrown = false;
+    try {blobs.write ([&] (Transaction& txn) {for (uint32_t num = 0; num < 4000; ++num) blobs.add (200000 + num, blob, txn);});
+    } catch (const MdbEx& ex) {thrown = ex._rc == MDB_MAP_FULL;}
+    if (!thrown) fail ("map grown past the limit");
+    if (blobs.first (200000u, ts)) fail ("200000");
+    mdb.setMapGrowth (2);
+    blobs.write ([&blobs] (Transaction& txn) {for (uint32_t num = 100000; num < 102000; ++num) blobs.erase (num, txn);});
+
+    // Parallel scans.
+    Mdb scanned (mdb._env, "scanned", false);
+    scanned.write ([&scanned] (Transaction& txn) {for (uint32_t num = 0; num < 10000; ++num) scanned.add (num * 7, num, txn);});
+    uint32_t nonEmpty = 0;
+    std::vector<uint32_t> scannedKeys = scanned.parallelScan (std::vector<uint32_t>(), std::vector<uint32_t>(),
+      [] (std::vector<uint32_t>& keys, const IteratorEntry& entry) {keys.push_back (entry.getKey<uint32_t>()); return true;},
+      [&nonEmpty] (std::vector<uint32_t>& into, std::vector<uint32_t>& chunk) {
+        nonEmpty += chunk.empty() ? 0 : 1;
+        into.insert (into.end(), chunk.begin(), chunk.end());}, 4);
+    if (scannedKeys.size() != 10000) fail ("parallelScan count");
+    for (uint32_t num = 0; num < 10000; ++num) if (scannedKeys[num] != num * 7) fail ("parallelScan order");
+    if (nonEmpty < 8) fail ("parallelScan chunks");
+    std::atomic<uint32_t> seen {0};
+    scanned.parallelScan (0, 0, [&seen] (int&, const IteratorEntry&) {return ++seen < 100;}, [] (int&, int&) {}, 4);
+    if (seen >= 10000) fail ("parallelScan stop");
+    if (scanned.parallelScan ((size_t) 1000, (size_t) 0, [] (size_t& count, const IteratorEntry&) {++count; return true;},
+          [] (size_t& into, size_t& chunk) {into += chunk;}, 4) != 11000) fail ("parallelScan init");
+    if (scanned.parallelScan (UINT32_MAX, UINT32_MAX, [] (uint32_t& least, const IteratorEntry& entry) {least = std::min (least, entry.getKey<uint32_t>()); return true;},
+          [] (uint32_t& into, uint32_t& chunk) {into = std::min (into, chunk);}, 4) != 0) fail ("parallelScan identity");
+    // Boost-serialized strings start with their length, the chunks should still be about even.
+    Mdb named (mdb._env, "named", false);
+    named.write ([&named] (Transaction& txn) {for (uint32_t num = 0; num < 10000; ++num) named.add (std::string ("k") + std::to_string (num), num, txn);});
+    std::vector<size_t> chunkSizes = named.parallelScan (std::vector<size_t>(), std::vector<size_t> (1, 0),
+      [] (std::vector<size_t>& count, const IteratorEntry&) {++count[0]; return true;},
+      [] (std::vector<size_t>& into, std::vector<size_t>& chunk) {into.push_back (chunk[0]);}, 4);
+    if (std::accumulate (chunkSizes.begin(), chunkSizes.end(), (size_t) 0) != 10000) fail ("parallelScan named count");
+    if (*std::max_element (chunkSizes.begin(), chunkSizes.end()) > 10000 / 8) fail ("parallelScan named balance");
+    keys = numeric.parallelScan (std::vector<uint32_t>(), std::vector<uint32_t>(),
+      [] (std::vector<uint32_t>& keys, const IteratorEntry& entry) {keys.push_back (entry.getKey<uint32_t>()); return true;},
+      [] (std::vector<uint32_t>& into, std::vector<uint32_t>& chunk) {into.insert (into.end(), chunk.begin(), chunk.end());}, 3);
+    if (keys != std::vector<uint32_t> ({1, 1, 256, 256, 65536, 65536})) fail ("parallelScan INTEGERKEY");
   }
 
   virtual ~Mdb() {
+    stopAsyncTriggers(); // Apply the logged changes while the triggers are there.
     _triggers.clear(); // Destroy triggers before closing the database.
     if (_dbi) {::mdb_close (_env.get(), _dbi); _dbi = 0;}
   }
 };
 
+/**
+ * Spreads the keys over several MDB environments, each with its own `Mdb::Writer` thread,
+ * in order to scale the writes beyond the single writer of an environment (and over several disks).\n
+ * The shard of a key is picked by the hash of the serialized key, hence the number of shards shouldn't change for an existing store.\n
+ * All the values of a key live in the same shard, so `first` and `all` read a single environment.
+ */
+struct ShardedMdb {
+  std::vector<std::unique_ptr<Mdb>> _shards;
+  std::vector<std::unique_ptr<Mdb::Writer>> _writers; ///< NB: Declared after the `_shards` in order to be stopped before them.
+
+  /** Opens an environment per path (see the `Mdb` constructor for the rest of the parameters).
+   * @param maxBatch The maximum number of mutations in a single transaction of a shard (see `Mdb::Writer`). */
+  ShardedMdb (const std::vector<std::string>& paths, size_t maxSizeMb = 1024, const char* dbName = "main", uint8_t sync = 0, bool dup = true,
+              mode_t mode = 0660, unsigned flags = 0, uint32_t maxBatch = 1024) {
+    if (paths.empty()) throw MdbEx ("ShardedMdb: no paths");
+    for (const std::string& path: paths) {
+      _shards.emplace_back (new Mdb (path.c_str(), maxSizeMb, dbName, sync, dup, mode, flags));
+      _writers.emplace_back (new Mdb::Writer (*_shards.back(), maxBatch));
+    }
+  }
+
+  size_t shards() const {return _shards.size();}
+  /** The shard holding the `key`. */
+  template <typename K> uint32_t shardOf (const K& key) const {
+    char kbuf[64]; // Allow up to 64 bytes to be serialized without heap allocations.
+    gstring kbytes (sizeof (kbuf), kbuf, false, 0);
+    _shards[0]->keyBytes (kbytes, key);
+    return std::hash<gstring>() (kbytes) % _shards.size();
+  }
+  Mdb& shard (uint32_t num) {return *_shards[num];}
+  Mdb::Writer& writer (uint32_t num) {return *_writers[num];}
+
+  /** Queues the addition with the shard's writer.
+   * @return The future which becomes ready when the addition is committed. */
+  template <typename K, typename V> std::future<void> addAsync (const K& key, const V& value) {return _writers[shardOf (key)]->add (key, value);}
+  /** Adds the value, waiting for the commit. The concurrent additions to the same shard share the transaction. */
+  template <typename K, typename V> void add (const K& key, const V& value) {addAsync (key, value) .get();}
+  template <typename K, typename V> bool first (const K& key, V& value) {return _shards[shardOf (key)]->first (key, value);}
+  /** Iterate over `key` values until `visitor` returns `false`. Return the number of values visited. */
+  template <typename K, typename V> int32_t all (const K& key, std::function<bool(const V&)> visitor) {return _shards[shardOf (key)]->all (key, visitor);}
+  template <typename K, typename V> bool eraseKV (const K& key, const V& value) {return _writers[shardOf (key)]->eraseKV (key, value) .get();}
+  /** Erase all values of the `key`. */
+  template <typename K> bool erase (const K& key) {return _writers[shardOf (key)]->erase (key) .get();}
+
+  /** Visits all the records, a thread per shard, each shard in its own read-only transaction.\n
+   * `visitor (uint32_t shard, const Mdb::IteratorEntry&)` is invoked concurrently from the shard threads and returns `false` to stop the shard.\n
+   * An exception thrown by the visitor is rethrown after all the threads are done.
+   * @return The number of records visited. */
+  template <typename Visitor> uint64_t parallelScan (Visitor visitor) {
+    std::vector<std::thread> threads; std::vector<std::exception_ptr> errors (_shards.size());
+    std::atomic<uint64_t> visited {0};
+    for (uint32_t num = 0; num < _shards.size(); ++num) threads.emplace_back ([this,num,&visitor,&errors,&visited]() {
+      try {
+        Mdb& mdb = *_shards[num];
+        Mdb::Transaction txn (mdb.beginTransaction (MDB_RDONLY));
+        MDB_cursor* cur = nullptr; int rc = ::mdb_cursor_open (txn.get(), mdb._dbi, &cur);
+        if (rc) throw MdbEx (std::string ("parallelScan, mdb_cursor_open: ") + ::mdb_strerror (rc));
+        std::unique_ptr<MDB_cursor, void(*)(MDB_cursor*)> curHolder (cur, ::mdb_cursor_close);
+        Mdb::IteratorEntry entry; entry._dbFlags = mdb._dbFlags;
+        uint64_t count = 0;
+        for (rc = ::mdb_cursor_get (cur, &entry._key, &entry._val, ::MDB_FIRST); rc == 0; rc = ::mdb_cursor_get (cur, &entry._key, &entry._val, ::MDB_NEXT)) {
+          ++count;
+          if (!visitor (num, (const Mdb::IteratorEntry&) entry)) break;
+        }
+        if (rc && rc != MDB_NOTFOUND) throw MdbEx (std::string ("parallelScan, mdb_cursor_get: ") + ::mdb_strerror (rc));
+        visited += count;
+      } catch (...) {errors[num] = std::current_exception();}
+    });
+    for (auto& thread: threads) thread.join();
+    for (auto& error: errors) if (error) std::rethrow_exception (error);
+    return visited;
+  }
+
+  static void test (const std::vector<std::string>& paths) {
+    auto fail = [](std::string msg) {throw std::runtime_error ("assertion failed: " + msg);};
+    ShardedMdb sharded (paths, 64);
+    std::vector<std::thread> threads;
+    for (uint32_t th = 0; th < 3; ++th) threads.emplace_back ([&sharded,th]() {
+      for (uint32_t num = th * 100; num < th * 100 + 100; ++num) sharded.add (num, (int) num);});
+    for (auto& thread: threads) thread.join();
+    sharded.add ((uint32_t) 7, 70);
+    int value = 0; if (!sharded.first ((uint32_t) 150, value) || value != 150) fail ("!150=150");
+    int32_t count = sharded.all<uint32_t, int> ((uint32_t) 7, [] (const int&) {return true;});
+    if (count != 2) fail ("!7=7,70");
+    std::vector<std::atomic<uint32_t>> perShard (sharded.shards());
+    uint64_t keySum = 0; std::mutex keySumMutex;
+    uint64_t visited = sharded.parallelScan ([&] (uint32_t shard, const Mdb::IteratorEntry& entry) {
+      ++perShard[shard];
+      std::lock_guard<std::mutex> lock (keySumMutex); keySum += entry.getKey<uint32_t>(); return true;});
+    if (visited != 301) fail ("parallelScan count");
+    if (keySum != 299 * 300 / 2 + 7) fail ("parallelScan keys");
+    for (auto& records: perShard) if (records == 0) fail ("an empty shard");
+    for (uint32_t num = 0; num < 300; ++num) if (!sharded.erase (num)) fail ("!erase");
+    if (sharded.parallelScan ([] (uint32_t, const Mdb::IteratorEntry&) {return true;}) != 0) fail ("not erased");
+  }
+};
+
 } // namespace glim
 
 #endif // _GLIM_MDB_HPP_INCLUDED
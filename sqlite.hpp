@@ -24,8 +24,25 @@ limitations under the License.
  * @file
  */
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility> // index_sequence
+#include <vector>
 #include <sqlite3.h>
 #include <pthread.h>
 #include <string.h> // strerror
@@ -40,11 +57,41 @@ namespace glim {
 
 class SqliteSession;
 class SqliteQuery;
+template <typename... Ts> class SqliteRows;
 
 struct SqliteEx: public std::runtime_error {
   SqliteEx (const std::string& what): std::runtime_error (what) {}
 };
 
+/**
+ * Exponential backoff with jitter for the SQLITE_BUSY waits (see Sqlite#busyBackoff and SqliteParQuery).\n
+ * The n-th wait is \c initialMs * \c factor^n milliseconds, up to \c maxMs, less a random share (up to \c jitter) of it,
+ * so that the competing processes don't retry in lockstep. The waiting stops after \c deadlineMs milliseconds in total.
+ */
+struct SqliteBackoff {
+  int initialMs, maxMs, deadlineMs;
+  double factor, jitter;
+  SqliteBackoff (int initialMs = 1, int maxMs = 100, int deadlineMs = 10000, double factor = 2.0, double jitter = 0.5)
+    : initialMs (initialMs), maxMs (maxMs), deadlineMs (deadlineMs), factor (factor), jitter (jitter) {}
+  /// The wait before the retry number \c attempt (0-based), in milliseconds.
+  int delayMs (int attempt) const {
+    double delay = initialMs;
+    for (int num = 0; num < attempt && delay < maxMs; ++num) delay *= factor;
+    if (delay > maxMs) delay = maxMs;
+    static thread_local std::minstd_rand random ((unsigned) std::chrono::steady_clock::now().time_since_epoch().count());
+    delay *= 1.0 - jitter * std::uniform_real_distribution<double> (0.0, 1.0) (random);
+    return delay < 1 ? 1 : (int) delay;
+  }
+  /// Sleeps before the retry number \c attempt. Returns \c false instead if the \c deadlineMs since \c started has passed.
+  bool wait (int attempt, std::chrono::steady_clock::time_point started) const {
+    const int elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now() - started) .count();
+    if (elapsed >= deadlineMs) return false;
+    const int delay = delayMs (attempt);
+    ::sqlite3_sleep (delay < deadlineMs - elapsed ? delay : deadlineMs - elapsed);
+    return true;
+  }
+};
+
 /**
  * The database.
  * According to sqlite3_open <a href="http://sqlite.org/capi3ref.html#sqlite3_open">documentation</a>,
@@ -77,12 +124,104 @@ class Sqlite {
   /// No copying allowed.
   Sqlite (const Sqlite& other) = delete;
   friend class SqliteSession;
+  friend class SqliteQuery;
   protected:
   /// Filename the database was opened with; we need it to reopen the database on fork()s.
   /// std::string is used to avoid memory allocation issues.
   std::string filename;
   ::sqlite3* handler;
   ::pthread_mutex_t mutex;
+  typedef std::list<std::pair<std::string, ::sqlite3_stmt*> > StmtLru;
+  /// Idle prepared statements with their SQL, the most recently used first (see #setStatementCache).
+  StmtLru stmtLru;
+  std::unordered_map<std::string, StmtLru::iterator> stmtIndex;
+  size_t stmtCapacity;
+  std::atomic<uint64_t> stmtHits, stmtMisses;
+  /// Connections of the read-only sessions, see #pool. Only added to (by #pool) until the Sqlite is destroyed.
+  std::vector<std::unique_ptr<Sqlite> > readers;
+  /// Guards the #readers list against the concurrent sessions. Never held while waiting for a connection.
+  mutable std::mutex readersMutex;
+  /// Serializes the configuration of the connections (#pool, #busyBackoff, #setStatementCache).
+  std::mutex configMutex;
+  /// A copy of the #readers list, for configuring them without holding the #readersMutex.
+  std::vector<Sqlite*> readerList () {
+    std::lock_guard<std::mutex> lock (readersMutex);
+    std::vector<Sqlite*> list; for (auto& reader: readers) list.push_back (reader.get());
+    return list;
+  }
+  std::atomic<uint32_t> nextReader;
+  /// See #busyBackoff.
+  SqliteBackoff backoff;
+  /// Whether the #backoff was installed, the readers added later by #pool get it as well.
+  bool busyHandling;
+  std::chrono::steady_clock::time_point busySince;
+
+  static int busyHandler (void* arg, int count) {
+    Sqlite* db = (Sqlite*) arg;
+    if (count == 0) db->busySince = std::chrono::steady_clock::now();
+    return db->backoff.wait (count, db->busySince) ? 1 : 0;
+  }
+
+  /// Locks a reader connection, preferring the idle ones. NULL if there are no readers.
+  Sqlite* lockReader () {
+    Sqlite* reader;
+    {std::lock_guard<std::mutex> lock (readersMutex);
+      if (readers.empty()) return NULL;
+      const size_t count = readers.size(), first = nextReader++ % count;
+      for (size_t num = 0; num < count; ++num) {
+        reader = readers[(first + num) % count].get();
+        if (::pthread_mutex_trylock (&reader->mutex) == 0) return reader;
+      }
+      reader = readers[first].get();} // Waited for outside of the `readersMutex`, the readers being never removed.
+    int err = ::pthread_mutex_lock (&reader->mutex);
+    if (err != 0) throw SqliteEx (std::string ("error locking the mutex: ") + ::strerror(err));
+    return reader;
+  }
+
+  /**
+   * A prepared statement for the query, reused from the cache if there is one.
+   * Invoked from within a session.
+   * @throws SqliteEx if sqlite3_prepare fails; format of the error message is "$query: $errmsg".
+   */
+  ::sqlite3_stmt* takeStatement (char const* query, int queryLength) {
+    std::string sql (query, queryLength >= 0 ? (size_t) queryLength : ::strlen (query));
+    if (stmtCapacity) {
+      auto it = stmtIndex.find (sql);
+      if (it != stmtIndex.end()) {
+        ::sqlite3_stmt* statement = it->second->second;
+        stmtLru.erase (it->second); stmtIndex.erase (it);
+        ++stmtHits;
+        return statement;
+      }
+    }
+    ++stmtMisses;
+    ::sqlite3_stmt* statement = NULL;
+    if (::sqlite3_prepare_v2 (handler, sql.data(), sql.size(), &statement, NULL) != SQLITE_OK)
+      throw SqliteEx (sql + ": " + ::sqlite3_errmsg(handler));
+    return statement;
+  }
+  /**
+   * Resets the statement and keeps it for the next query with the same SQL,
+   * finalizing the least recently used statements over the capacity.
+   * Invoked from within a session.
+   */
+  void returnStatement (::sqlite3_stmt* statement) {
+    const char* sql = ::sqlite3_sql (statement);
+    if (!stmtCapacity || !sql) {::sqlite3_finalize (statement); return;}
+    ::sqlite3_reset (statement); ::sqlite3_clear_bindings (statement);
+    std::string key (sql);
+    if (stmtIndex.count (key)) {::sqlite3_finalize (statement); return;} // Several queries with the same SQL were open.
+    stmtLru.push_front (std::make_pair (key, statement));
+    stmtIndex[key] = stmtLru.begin();
+    trimStatements();
+  }
+  void trimStatements() {
+    while (stmtLru.size() > stmtCapacity) {
+      ::sqlite3_finalize (stmtLru.back().second);
+      stmtIndex.erase (stmtLru.back().first);
+      stmtLru.pop_back();
+    }
+  }
   public:
   /// Flags for the Sqlite constructor.
   enum Flags {
@@ -108,6 +247,7 @@ class Sqlite {
     }
     ::pthread_mutex_init (&mutex, NULL);
     this->filename = filename;
+    stmtCapacity = 32; stmtHits = 0; stmtMisses = 0; nextReader = 0; busyHandling = false;
     if (::sqlite3_open(filename.c_str(), &handler) != SQLITE_OK)
       throw SqliteEx (std::string("sqlite3_open(") + filename + "): " + ::sqlite3_errmsg(handler));
   }
@@ -116,6 +256,8 @@ class Sqlite {
    * @throws SqliteEx Thrown if we can't close the database.
    */
   ~Sqlite () {
+    readers.clear();
+    stmtCapacity = 0; trimStatements();
     ::pthread_mutex_destroy (&mutex);
     if (::sqlite3_close(handler) != SQLITE_OK)
       throw SqliteEx (std::string ("sqlite3_close(): ") + ::sqlite3_errmsg(handler));
@@ -129,6 +271,53 @@ class Sqlite {
    *   for (std::string pv: {"page_size = 4096", "secure_delete = 1"}) sqlite->exec2 ("PRAGMA " + pv); \endcode
    */
   template <typename StringLike> Sqlite& exec2 (StringLike query) {return exec (query.c_str());}
+
+  /**
+   * Keeps up to \c capacity idle prepared statements (32 by default), handing them to the later queries with the identical SQL
+   * instead of preparing the SQL again. A statement returns to the cache, reset and with the bindings cleared, when its SqliteQuery is destroyed.\n
+   * Zero disables the cache.
+   * Waits for the reader connections in use, hence shouldn't be called from a read-only session.
+   */
+  void setStatementCache (size_t capacity);
+  /// The number of queries which got a cached statement (including the reader connections, see #pool).
+  uint64_t statementCacheHits () const {
+    std::lock_guard<std::mutex> lock (readersMutex);
+    uint64_t hits = stmtHits; for (auto& reader: readers) hits += reader->stmtHits; return hits;}
+  /// The number of queries which prepared their statement (including the reader connections, see #pool).
+  uint64_t statementCacheMisses () const {
+    std::lock_guard<std::mutex> lock (readersMutex);
+    uint64_t misses = stmtMisses; for (auto& reader: readers) misses += reader->stmtMisses; return misses;}
+
+  /**
+   * Switches the database into the WAL journal mode and opens \c count reader connections for the read-only sessions
+   * (see SqliteSession#readOnly), which then run concurrently with each other and with the writer session.\n
+   * The sessions which aren't read-only share the original connection, one at a time, as before.
+   * The readers are opened with "PRAGMA query_only".
+   * Can be called while the sessions run, adding more readers.\n
+   * Requires a file database and an SQLite built with SQLITE_THREADSAFE 1 or 2 (the default).
+   * @throws SqliteEx if the database can't be switched into the WAL mode.
+   */
+  Sqlite& pool (int count);
+  /**
+   * Runs a WAL checkpoint on the writer connection.
+   * @param mode SQLITE_CHECKPOINT_PASSIVE, SQLITE_CHECKPOINT_FULL, SQLITE_CHECKPOINT_RESTART or SQLITE_CHECKPOINT_TRUNCATE.
+   * @return The number of frames in the WAL and the number of frames checkpointed.
+   * @see http://sqlite.org/c3ref/wal_checkpoint_v2.html
+   */
+  std::pair<int, int> checkpoint (int mode = SQLITE_CHECKPOINT_PASSIVE);
+  /**
+   * Installs a busy handler (sqlite3_busy_handler) which waits for the locks of the other connections and processes
+   * with the exponential \c backoff, giving up (SQLITE_BUSY, "database is locked") after the \c backoff deadline.
+   * Applies to the reader connections as well, including the ones added by a later #pool.
+   * Waits for the reader connections in use, hence shouldn't be called from a read-only session.
+   * @see http://sqlite.org/c3ref/busy_handler.html
+   */
+  Sqlite& busyBackoff (const SqliteBackoff& backoff);
+  /**
+   * Checkpoint the WAL automatically when it grows over \c frames pages (1000 by default in SQLite), zero disables.
+   * @see http://sqlite.org/c3ref/wal_autocheckpoint.html
+   */
+  Sqlite& autoCheckpoint (int frames);
 };
 
 /**
@@ -138,6 +327,7 @@ class Sqlite {
  * till the active session is either closed or destructed.
  */
 class SqliteSession {
+  friend class SqliteQuery;
   /// No copying allowed.
   SqliteSession& operator = (const SqliteSession& other) {return *this;}
   /// No copying allowed.
@@ -145,11 +335,23 @@ class SqliteSession {
   protected:
   Sqlite* db;
   public:
+  /// Session modes.
+  enum Mode {
+    readWrite = 0,
+    /**
+     * The session only reads: it gets one of the reader connections of a pooled database (see Sqlite#pool)
+     * and runs concurrently with the other sessions. Without the pool it is an ordinary session.\n
+     * Usage example: \code glim::SqliteSession ses (&db, glim::SqliteSession::readOnly); \endcode
+     */
+    readOnly = 1
+  };
   /**
-   * Locks the database.
+   * Locks the database (or one of its reader connections).
    * @throws SqliteEx if a mutex error occurs.
    */
-  SqliteSession (Sqlite* sqlite): db (sqlite) {
+  SqliteSession (Sqlite* sqlite, Mode mode = readWrite): db (mode == readOnly ? sqlite->lockReader() : NULL) {
+    if (db) return;
+    db = sqlite;
     int err = ::pthread_mutex_lock (&(db->mutex));
     if (err != 0) throw SqliteEx (std::string ("error locking the mutex: ") + ::strerror(err));
   }
@@ -160,6 +362,15 @@ class SqliteSession {
    */
   template <typename T>
   SqliteQuery query (T t);
+  /**
+   * Runs the query, binding the \c args (with SqliteQuery#operator<<), and iterates over its rows as tuples of the \c Ts.
+   * Usage example: \code
+   *   for (auto [id, name, score]: ses.rows<int64_t, gstring, double> ("SELECT id, name, score FROM test WHERE score > ?", 0.5)) ...
+   * \endcode
+   * @see SqliteColumn
+   */
+  template <typename... Ts, typename T, typename... Args>
+  SqliteRows<Ts...> rows (T t, Args... args);
   /// Automatically unlocks the database.
   /// @see close
   ~SqliteSession () {close();}
@@ -206,6 +417,94 @@ inline Sqlite& Sqlite::exec (const char* query) {
   return *this;
 }
 
+inline Sqlite& Sqlite::pool (int count) {
+  if (::sqlite3_threadsafe() == 0) throw SqliteEx ("Sqlite::pool: SQLite is built without the thread safety");
+  {SqliteSession ses (this);
+    char** table = NULL; int rows = 0, columns = 0; char* errmsg = NULL;
+    ::sqlite3_get_table (handler, "PRAGMA journal_mode = WAL", &table, &rows, &columns, &errmsg);
+    if (errmsg) {std::string err (errmsg); ::sqlite3_free (errmsg); throw SqliteEx ("Sqlite::pool, journal_mode: " + err);}
+    std::string mode (rows == 1 && columns == 1 && table[1] ? table[1] : "");
+    ::sqlite3_free_table (table);
+    if (mode != "wal") throw SqliteEx (filename + ": can't switch into the WAL mode (" + mode + ")");}
+  std::lock_guard<std::mutex> config (configMutex); // The new readers get the current #busyBackoff and #setStatementCache.
+  for (int num = 0; num < count; ++num) {
+    std::unique_ptr<Sqlite> reader (new Sqlite (filename));
+    reader->exec ("PRAGMA query_only = 1");
+    reader->stmtCapacity = stmtCapacity;
+    if (busyHandling) reader->busyBackoff (backoff);
+    std::lock_guard<std::mutex> lock (readersMutex);
+    readers.push_back (std::move (reader));
+  }
+  return *this;
+}
+
+inline std::pair<int, int> Sqlite::checkpoint (int mode) {
+  SqliteSession ses (this); // Maintains the locks.
+  int logFrames = 0, checkpointed = 0;
+  int rc = ::sqlite3_wal_checkpoint_v2 (handler, NULL, mode, &logFrames, &checkpointed);
+  if (rc != SQLITE_OK && rc != SQLITE_BUSY) throw SqliteEx (std::string ("sqlite3_wal_checkpoint_v2: ") + ::sqlite3_errmsg (handler));
+  return std::make_pair (logFrames, checkpointed);
+}
+
+inline Sqlite& Sqlite::busyBackoff (const SqliteBackoff& backoff) {
+  std::lock_guard<std::mutex> config (configMutex);
+  for (Sqlite* reader: readerList()) reader->busyBackoff (backoff);
+  SqliteSession ses (this); // Maintains the locks.
+  this->backoff = backoff; busyHandling = true;
+  if (::sqlite3_busy_handler (handler, &Sqlite::busyHandler, this) != SQLITE_OK)
+    throw SqliteEx (std::string ("sqlite3_busy_handler: ") + ::sqlite3_errmsg (handler));
+  return *this;
+}
+
+inline Sqlite& Sqlite::autoCheckpoint (int frames) {
+  SqliteSession ses (this); // Maintains the locks.
+  if (::sqlite3_wal_autocheckpoint (handler, frames) != SQLITE_OK) throw SqliteEx (std::string ("sqlite3_wal_autocheckpoint: ") + ::sqlite3_errmsg (handler));
+  return *this;
+}
+
+inline void Sqlite::setStatementCache (size_t capacity) {
+  std::lock_guard<std::mutex> config (configMutex);
+  for (Sqlite* reader: readerList()) reader->setStatementCache (capacity);
+  SqliteSession ses (this); // Maintains the locks.
+  stmtCapacity = capacity;
+  trimStatements();
+}
+
+/**
+ * Reads a column of the type \c T from the current row of the statement (see SqliteQuery#at, SqliteQuery#row and SqliteRows).\n
+ * Integers and floating point numbers are converted by SQLite, SQL NULL becomes zero or an empty string.
+ * Specialize it to read the columns into the other types.
+ */
+template <typename T, typename Enable = void> struct SqliteColumn;
+template <typename T> struct SqliteColumn<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+  static T get (::sqlite3_stmt* statement, int column) {return (T) ::sqlite3_column_int64 (statement, column);}
+};
+template <typename T> struct SqliteColumn<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+  static T get (::sqlite3_stmt* statement, int column) {return (T) ::sqlite3_column_double (statement, column);}
+};
+template <> struct SqliteColumn<std::string> {
+  static std::string get (::sqlite3_stmt* statement, int column) {
+    const char* text = (const char*) ::sqlite3_column_text (statement, column);
+    return text ? std::string (text, ::sqlite3_column_bytes (statement, column)) : std::string();
+  }
+};
+/** The characters are valid until the next step. */
+template <> struct SqliteColumn<std::pair<char const*, int> > {
+  static std::pair<char const*, int> get (::sqlite3_stmt* statement, int column) {
+    const char* text = (const char*) ::sqlite3_column_text (statement, column);
+    return std::pair<char const*, int> (text, ::sqlite3_column_bytes (statement, column));
+  }
+};
+#ifdef _GSTRING_INCLUDED
+/** Zero-copy view of the column bytes (TEXT or BLOB), valid until the next step. */
+template <> struct SqliteColumn<gstring> {
+  static gstring get (::sqlite3_stmt* statement, int column) {
+    const void* blob = ::sqlite3_column_blob (statement, column);
+    return gstring (0, (void*) blob, false, ::sqlite3_column_bytes (statement, column), true);
+  }
+};
+#endif
+
 /**
  * Wraps the sqlite3_stmt; will prepare it, bind values, query and finalize.
  */
@@ -216,10 +515,9 @@ class SqliteQuery {
   int bindCounter;
   /// -1 if statement isn't DONE.
   int mChanges;
+  /// Takes the statement from the statement cache of the database, or prepares it (see Sqlite#setStatementCache).
   void prepare (SqliteSession* session, char const* query, int queryLength) {
-    ::sqlite3* handler = *session;
-    if (::sqlite3_prepare_v2 (handler, query, queryLength, &statement, NULL) != SQLITE_OK)
-      throw SqliteEx (std::string(query, queryLength) + ": " + ::sqlite3_errmsg(handler));
+    statement = session->db->takeStatement (query, queryLength);
   }
   /** Shan't copy. */
   SqliteQuery (const SqliteQuery& other) = delete;
@@ -256,11 +554,13 @@ class SqliteQuery {
     prepare (session, query.c_str(), query.length());
   }
   /**
-   * Release resources.
+   * Release resources: returns the statement to the statement cache of the database or finalizes it.
    * @see http://sqlite.org/capi3ref.html#sqlite3_finalize
    */
   ~SqliteQuery () {
-    if (statement) ::sqlite3_finalize (statement);
+    if (!statement) return;
+    if (session && !session->isClosed()) session->db->returnStatement (statement);
+    else ::sqlite3_finalize (statement);
   }
   
   /// Call this (followed by the #step) if you need the query to be re-executed.
@@ -379,6 +679,69 @@ class SqliteQuery {
                         ::sqlite3_column_bytes (statement, column-1));
   }
   
+  /**
+   * Return the column bytes, which can be used until the next #step.
+   * @param column 1-based.
+   * @see http://sqlite.org/capi3ref.html#sqlite3_column_blob
+   */
+  std::pair<const void*, int> blobAt (int column) {
+    const void* blob = ::sqlite3_column_blob (statement, column-1);
+    return std::pair<const void*, int> (blob, ::sqlite3_column_bytes (statement, column-1));
+  }
+#ifdef _GSTRING_INCLUDED
+  /**
+   * Zero-copy view of the column bytes (TEXT or BLOB), which can be used until the next #step.
+   * @param column 1-based.
+   */
+  gstring gstringAt (int column) {
+    std::pair<const void*, int> blob = blobAt (column);
+    return gstring (0, (void*) blob.first, false, blob.second, true);
+  }
+#endif
+
+  /**
+   * The value of the given column, read with the SqliteColumn of the type \c T.
+   * Usage example: \code double score = query.at<double> (3); \endcode
+   * @param column 1-based.
+   */
+  template <typename T> T at (int column) {
+    return SqliteColumn<T>::get (statement, column - 1);
+  }
+  /**
+   * The current row as a tuple, the first column going into the first element.
+   * Usage example: \code std::tuple<int, std::string> pair = query.qstep().row<int, std::string>(); \endcode
+   */
+  template <typename... Ts> std::tuple<Ts...> row () {
+    return rowOf<Ts...> (std::index_sequence_for<Ts...>());
+  }
+  /**
+   * Steps through the remaining rows, appending a \c Struct to \c into for each,
+   * with the first column going into the first of the \c fields, the second column into the second and so on.\n
+   * Use std::string (not gstring) fields: the zero-copy views are only valid until the next step.
+   * Usage example: \code
+   *   struct Item {int64_t id; std::string name; double score;};
+   *   std::vector<Item> items;
+   *   ses.query ("SELECT id, name, score FROM items") .fill (items, &Item::id, &Item::name, &Item::score);
+   * \endcode
+   * @return The number of rows appended.
+   */
+  template <typename Struct, typename... Fields> size_t fill (std::vector<Struct>& into, Fields Struct::*... fields) {
+    size_t count = 0;
+    while (step()) {
+      into.emplace_back();
+      Struct& entry = into.back();
+      int column = 0;
+      int expand[] = {0, ((void) (entry.*fields = SqliteColumn<Fields>::get (statement, column++)), 0)...};
+      (void) expand; ++count;
+    }
+    return count;
+  }
+ protected:
+  template <typename... Ts, size_t... Columns> std::tuple<Ts...> rowOf (std::index_sequence<Columns...>) {
+    return std::tuple<Ts...> (SqliteColumn<Ts>::get (statement, Columns)...);
+  }
+ public:
+
   /**
    * The type of the column.
    * SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL.
@@ -455,12 +818,284 @@ class SqliteQuery {
       throw SqliteEx (std::string (::sqlite3_errmsg (*session)));
     return *this;
   }
+  /**
+   * Bind a floating point number to the query.
+   */
+  SqliteQuery& bind (int index, double value) {
+    if (::sqlite3_bind_double (statement, index, value) != SQLITE_OK)
+      throw SqliteEx (std::string (::sqlite3_errmsg (*session)));
+    return *this;
+  }
+  /**
+   * Bind a BLOB to the query.
+   * @param transient must be true, if lifetime of the data might be shorter than that of the query.
+   */
+  SqliteQuery& bindBlob (int index, const void* data, int size, bool transient = false) {
+    if (::sqlite3_bind_blob (statement, index, data, size,
+                             transient ? SQLITE_TRANSIENT : SQLITE_STATIC) != SQLITE_OK)
+      throw SqliteEx (std::string (::sqlite3_errmsg (*session)));
+    return *this;
+  }
+  /**
+   * Bind a BLOB of \c size zero bytes, to be filled with SqliteBlob later.
+   */
+  SqliteQuery& bindZeroBlob (int index, int size) {
+    if (::sqlite3_bind_zeroblob (statement, index, size) != SQLITE_OK)
+      throw SqliteEx (std::string (::sqlite3_errmsg (*session)));
+    return *this;
+  }
+#ifdef _GSTRING_INCLUDED
+  /**
+   * Bind a string to the query.
+   * @param transient must be true, if lifetime of the string might be shorter than that of the query;
+   * \c false binds the gstring bytes without a copy.
+   */
+  SqliteQuery& bind (int index, const gstring& text, bool transient = true) {
+    if (::sqlite3_bind_text (statement, index, text.data(), text.length(),
+                             transient ? SQLITE_TRANSIENT : SQLITE_STATIC) != SQLITE_OK)
+      throw SqliteEx (std::string (::sqlite3_errmsg (*session)));
+    return *this;
+  }
+  /**
+   * Bind the gstring bytes as a BLOB.
+   * @param transient must be true, if lifetime of the bytes might be shorter than that of the query.
+   */
+  SqliteQuery& bindBlob (int index, const gstring& bytes, bool transient = false) {
+    return bindBlob (index, bytes.data(), bytes.length(), transient);
+  }
+  /**
+   * Binds a string without the intermediate copy of the #operator<< template.
+   */
+  SqliteQuery& operator << (const gstring& text) {
+    return bind (++bindCounter, text);
+  }
+#endif
+};
+
+/**
+ * The rows of a query as tuples of the column types \c Ts (see SqliteSession#rows and SqliteColumn).
+ * The columns are read straight into the tuple, without the per-column calls and type checks of the SqliteQuery accessors.\n
+ * It is an input range: it can only be iterated once.
+ */
+template <typename... Ts> class SqliteRows {
+ protected:
+  SqliteQuery query;
+ public:
+  typedef std::tuple<Ts...> value_type;
+  class iterator {
+    SqliteRows* rows; ///< \c NULL at the end.
+   public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef std::tuple<Ts...> value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef value_type reference;
+    iterator (SqliteRows* rows): rows (rows) {}
+    value_type operator * () const {return rows->query.template row<Ts...>();}
+    iterator& operator ++ () {if (!rows->query.step()) rows = NULL; return *this;}
+    bool operator == (const iterator& other) const {return rows == other.rows;}
+    bool operator != (const iterator& other) const {return rows != other.rows;}
+  };
+  SqliteRows (SqliteQuery&& query): query (std::move (query)) {}
+  /// Steps to the first row.
+  iterator begin () {return iterator (query.step() ? this : NULL);}
+  iterator end () {return iterator (NULL);}
+  /// The underlying query, positioned at the current row.
+  SqliteQuery& statement () {return query;}
+};
+
+/**
+ * Incremental I/O of a BLOB (sqlite3_blob_open), for the values too large to be bound or read in one piece.
+ * The space is usually reserved with SqliteQuery#bindZeroBlob first.\n
+ * The SqliteBlob must be closed (destroyed) before the session.
+ * Usage example: \code
+ *   ses.query ("INSERT INTO files (data) VALUES (?)") .bindZeroBlob (1, size) .ustep();
+ *   glim::SqliteBlob blob (&ses, "files", "data", ::sqlite3_last_insert_rowid (ses), true);
+ *   blob.write (chunk, chunkSize, offset);
+ * \endcode
+ * @see http://sqlite.org/c3ref/blob_open.html
+ */
+class SqliteBlob {
+ protected:
+  ::sqlite3_blob* blob;
+  SqliteSession* session;
+  /** Shan't copy. */
+  SqliteBlob (const SqliteBlob& other) = delete;
+ public:
+  /**
+   * Opens the BLOB in the \c column of the \c table row \c rowid.
+   * @param write Whether to open the BLOB for writing.
+   * @throws SqliteEx if sqlite3_blob_open fails.
+   */
+  SqliteBlob (SqliteSession* session, const char* table, const char* column, sqlite3_int64 rowid, bool write = false, const char* db = "main")
+    : blob (NULL), session (session) {
+    if (::sqlite3_blob_open (*session, db, table, column, rowid, write ? 1 : 0, &blob) != SQLITE_OK) {
+      std::string err (::sqlite3_errmsg (*session));
+      if (blob) {::sqlite3_blob_close (blob); blob = NULL;}
+      throw SqliteEx (std::string ("sqlite3_blob_open (") + table + "." + column + "): " + err);
+    }
+  }
+  ~SqliteBlob () {
+    if (blob) ::sqlite3_blob_close (blob);
+  }
+  /// Moves to another row of the same table and column.
+  SqliteBlob& reopen (sqlite3_int64 rowid) {
+    if (::sqlite3_blob_reopen (blob, rowid) != SQLITE_OK)
+      throw SqliteEx (std::string ("sqlite3_blob_reopen: ") + ::sqlite3_errmsg (*session));
+    return *this;
+  }
+  /// The size of the BLOB in bytes.
+  int size () {return ::sqlite3_blob_bytes (blob);}
+  /// Reads \c size bytes from the \c offset of the BLOB into the \c buf.
+  SqliteBlob& read (void* buf, int size, int offset) {
+    if (::sqlite3_blob_read (blob, buf, size, offset) != SQLITE_OK)
+      throw SqliteEx (std::string ("sqlite3_blob_read: ") + ::sqlite3_errmsg (*session));
+    return *this;
+  }
+  /// Writes \c size bytes at the \c offset of the BLOB. The size of the BLOB can't be changed this way.
+  SqliteBlob& write (const void* data, int size, int offset) {
+    if (::sqlite3_blob_write (blob, data, size, offset) != SQLITE_OK)
+      throw SqliteEx (std::string ("sqlite3_blob_write: ") + ::sqlite3_errmsg (*session));
+    return *this;
+  }
+};
+
+/**
+ * Inserts many rows, several rows per statement (a multi-row VALUES) and many rows per transaction,
+ * saving on the per-row journal syncs of the autocommit mode.\n
+ * The values are given column by column with the << operator and are bound when a statement's worth of rows is collected.
+ * The strings are copied into a shared buffer meanwhile, save for the \c std::pair<const char*, int>, which should live until then.\n
+ * The full-size statement is prepared once and reset between the runs.
+ * The transactions are begun and committed by the SqliteBulkInsert unless the session is in a transaction already.
+ * Usage example: \code
+ *   glim::SqliteBulkInsert insert (&ses, "INSERT INTO test (t, i)", 2);
+ *   for (auto& row: rows) insert << row.t << row.i;
+ *   insert.finish();
+ * \endcode
+ */
+class SqliteBulkInsert {
+ protected:
+  SqliteSession* session;
+  std::string head;
+  int columns, rowsPerStatement, rowsPerTransaction;
+  /// A value waiting to be bound: an integer, a floating point number or a string (either referenced or copied into the #copies).
+  struct Value {
+    enum Type {INTEGER, FLOAT, TEXT, COPIED_TEXT} type;
+    union {sqlite3_int64 integer; double real; const char* text; size_t offset;};
+    int length;
+  };
+  std::vector<Value> pending; ///< The values of the rows not inserted yet.
+  std::string copies; ///< The characters of the pending COPIED_TEXT values.
+  std::unique_ptr<SqliteQuery> full; ///< The statement inserting \c rowsPerStatement rows.
+  int64_t inserted, uncommitted;
+  bool ownTransaction;
+  std::chrono::steady_clock::time_point started;
+
+  std::string sql (int rows) const {
+    std::string row ("("); for (int column = 0; column < columns; ++column) row += column ? ",?" : "?"; row += ")";
+    std::string sql (head); sql += " VALUES ";
+    for (int num = 0; num < rows; ++num) {if (num) sql += ","; sql += row;}
+    return sql;
+  }
+  void exec (const char* sql) {
+    char* errmsg = NULL; ::sqlite3_exec (*session, sql, NULL, NULL, &errmsg);
+    if (errmsg) {std::string err (errmsg); ::sqlite3_free (errmsg); throw SqliteEx (std::string ("SqliteBulkInsert, ") + sql + ": " + err);}
+  }
+  void flush (int rows) {
+    if (!ownTransaction && ::sqlite3_get_autocommit (*session)) {exec ("BEGIN"); ownTransaction = true;}
+    SqliteQuery* query;
+    std::unique_ptr<SqliteQuery> tail;
+    if (rows == rowsPerStatement) {
+      if (full) full->reset(); else full.reset (new SqliteQuery (session, sql (rows)));
+      query = full.get();
+    } else {tail.reset (new SqliteQuery (session, sql (rows))); query = tail.get();}
+    for (size_t num = 0; num < pending.size(); ++num) {
+      const Value& value = pending[num]; const int index = num + 1;
+      switch (value.type) {
+        case Value::INTEGER: query->bind (index, value.integer); break;
+        case Value::FLOAT: query->bind (index, value.real); break;
+        case Value::TEXT: query->bind (index, value.text, value.length); break;
+        case Value::COPIED_TEXT: query->bind (index, copies.data() + value.offset, value.length); break;
+      }
+    }
+    query->ustep();
+    pending.clear(); copies.clear(); inserted += rows; uncommitted += rows;
+    if (ownTransaction && uncommitted >= rowsPerTransaction) commit();
+  }
+  void commit () {
+    exec ("COMMIT");
+    ownTransaction = false; uncommitted = 0;
+  }
+  SqliteBulkInsert& add (const Value& value) {
+    pending.push_back (value);
+    if ((int) pending.size() == columns * rowsPerStatement) flush (rowsPerStatement);
+    return *this;
+  }
+  SqliteBulkInsert& addCopy (const char* text, size_t length) {
+    Value value; value.type = Value::COPIED_TEXT; value.offset = copies.size(); value.length = length;
+    copies.append (text, length);
+    return add (value);
+  }
+ public:
+  /**
+   * @param head The beginning of the INSERT statement, up to the VALUES, for example "INSERT INTO test (t, i)".
+   * @param columns The number of values in a row.
+   * @param rowsPerStatement The number of rows in a multi-row VALUES (reduced to fit the SQLITE_LIMIT_VARIABLE_NUMBER).
+   * @param rowsPerTransaction Commit after that many rows.
+   */
+  SqliteBulkInsert (SqliteSession* session, const std::string& head, int columns, int rowsPerStatement = 64, int rowsPerTransaction = 10000)
+    : session (session), head (head), columns (columns), rowsPerStatement (rowsPerStatement), rowsPerTransaction (rowsPerTransaction),
+      inserted (0), uncommitted (0), ownTransaction (false), started (std::chrono::steady_clock::now()) {
+    const int maxVariables = ::sqlite3_limit (*session, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    if (columns < 1 || columns > maxVariables) throw SqliteEx ("SqliteBulkInsert: wrong number of columns");
+    if (this->rowsPerStatement > maxVariables / columns) this->rowsPerStatement = maxVariables / columns;
+    if (this->rowsPerStatement < 1) this->rowsPerStatement = 1;
+    pending.reserve (columns * this->rowsPerStatement);
+  }
+  /// Adds the next value of the row, inserting the rows when there is a statement's worth of them.
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value, SqliteBulkInsert&>::type operator << (T integer) {
+    Value value; value.type = Value::INTEGER; value.integer = (sqlite3_int64) integer; return add (value);
+  }
+  SqliteBulkInsert& operator << (double real) {Value value; value.type = Value::FLOAT; value.real = real; return add (value);}
+  SqliteBulkInsert& operator << (const std::string& text) {return addCopy (text.data(), text.size());}
+  SqliteBulkInsert& operator << (const char* text) {return addCopy (text, ::strlen (text));}
+  /// The characters are bound without a copy and should live until the row is inserted.
+  SqliteBulkInsert& operator << (std::pair<const char*, int> text) {
+    Value value; value.type = Value::TEXT; value.text = text.first; value.length = text.second; return add (value);
+  }
+#ifdef _GSTRING_INCLUDED
+  SqliteBulkInsert& operator << (const gstring& text) {return addCopy (text.data(), text.size());}
+#endif
+  /**
+   * Inserts the remaining rows and commits.
+   * @return The number of rows inserted.
+   * @throws SqliteEx if the last row is incomplete.
+   */
+  int64_t finish () {
+    if (pending.size() % columns) throw SqliteEx ("SqliteBulkInsert: the last row is incomplete");
+    if (!pending.empty()) flush (pending.size() / columns);
+    if (ownTransaction) commit();
+    return inserted;
+  }
+  /// The number of rows inserted so far.
+  int64_t rows () const {return inserted;}
+  /// The insertion speed since the SqliteBulkInsert was created.
+  double rowsPerSecond () const {
+    const double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - started) .count();
+    return seconds > 0 ? inserted / seconds : 0;
+  }
+  /// Rolls back the transaction begun by the SqliteBulkInsert if it wasn't finished (an exception, probably).
+  ~SqliteBulkInsert () {
+    full.reset();
+    if (ownTransaction) ::sqlite3_exec (*session, "ROLLBACK", NULL, NULL, NULL);
+  }
 };
 
 /**
  * Version of SqliteQuery suitable for using SQLite in parallel with other processes.
  * Will automatically handle the SQLITE_SCHEMA error
- * and will automatically repeat attempts after SQLITE_BUSY,
+ * and will automatically repeat attempts after SQLITE_BUSY, waiting with an exponential backoff (see SqliteBackoff),
  * but it requires that the query string supplied
  * is constant and available during the SqliteParQuery lifetime.
  * Error messages, contained in exceptions, may differ from SqliteQuery by containing the query
@@ -470,62 +1105,193 @@ class SqliteParQuery: public SqliteQuery {
   protected:
   char const* query;
   int queryLength;
-  int repeat;
-  int wait;
+  SqliteBackoff busy;
   public:
   /**
    * Prepares the query.
-   * @param repeat the number of times we try to repeat the query when SQLITE_BUSY is returned.
-   * @param wait how long, in milliseconds (1/1000 of a second) we are to wait before repeating.
+   * @param repeat together with the \c wait, limits the time we keep repeating the query when SQLITE_BUSY is returned
+   * (to \c repeat * \c wait milliseconds).
+   * @param wait the longest wait, in milliseconds (1/1000 of a second), between the repetitions is four times that.
    * @throws SqliteEx if sqlite3_prepare fails; format of the error message is "$query: $errmsg".
    */
   SqliteParQuery (SqliteSession* session, char const* query, int queryLength, int repeat = 90, int wait = 20)
-    : SqliteQuery (session, query, queryLength) {
+    : SqliteQuery (session, query, queryLength), busy (1, wait * 4, repeat * wait) {
     this->query = query;
     this->queryLength = queryLength;
-    this->repeat = repeat;
-    this->wait = wait;
   }
   /**
    * Prepares the query.
    * @param query the SQL query together with its length.
-   * @param repeat the number of times we try to repeat the query when SQLITE_BUSY is returned.
-   * @param wait how long, in milliseconds (1/1000 of a second) we are to wait before repeating.
+   * @param repeat together with the \c wait, limits the time we keep repeating the query when SQLITE_BUSY is returned
+   * (to \c repeat * \c wait milliseconds).
+   * @param wait the longest wait, in milliseconds (1/1000 of a second), between the repetitions is four times that.
    * @throws SqliteEx if sqlite3_prepare fails; format of the error message is "$query: $errmsg".
    */
   SqliteParQuery (SqliteSession* session, std::pair<char const*, int> query, int repeat = 90, int wait = 20)
-    : SqliteQuery (session, query) {
+    : SqliteQuery (session, query), busy (1, wait * 4, repeat * wait) {
     this->query = query.first;
     this->queryLength = query.second;
-    this->repeat = repeat;
-    this->wait = wait;
+  }
+  /// Replaces the default SQLITE_BUSY waiting strategy.
+  SqliteParQuery& backoff (const SqliteBackoff& busy) {
+    this->busy = busy;
+    return *this;
   }
   
   bool next () {return step();}
   bool step () {
     if (mChanges >= 0) {mChanges = 0; return false;}
-    repeat:
-    int ret = ::sqlite3_step (statement);
-    if (ret == SQLITE_ROW) return true;
-    if (ret == SQLITE_DONE) {
-      mChanges = ::sqlite3_changes (*session);
-      return false;
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    for (int attempt = 0;;) {
+      int ret = ::sqlite3_step (statement);
+      if (ret == SQLITE_ROW) return true;
+      if (ret == SQLITE_DONE) {
+        mChanges = ::sqlite3_changes (*session);
+        return false;
+      }
+      if (ret == SQLITE_SCHEMA) {
+        ::sqlite3_stmt* old = statement;
+        prepare (session, query, queryLength);
+        ::sqlite3_transfer_bindings(old, statement);
+        ::sqlite3_finalize (old);
+        continue;
+      }
+      if (ret == SQLITE_BUSY && busy.wait (attempt++, started)) continue;
+      throw SqliteEx (std::string(query, queryLength) + ": " + ::sqlite3_errmsg(*session));
     }
-    if (ret == SQLITE_SCHEMA) {
-      ::sqlite3_stmt* old = statement;
-      prepare (session, query, queryLength);
-      ::sqlite3_transfer_bindings(old, statement);
-      ::sqlite3_finalize (old);
-      goto repeat;
+  }
+};
+
+/** Keeps the result of a SqliteWriter job until the transaction is committed. */
+template <typename R> struct SqliteWriterResult {
+  R value;
+  template <typename Fun> void apply (Fun& fun, SqliteSession& ses) {value = fun (ses);}
+  void fulfil (std::promise<R>& promise) {promise.set_value (std::move (value));}
+};
+template <> struct SqliteWriterResult<void> {
+  template <typename Fun> void apply (Fun& fun, SqliteSession& ses) {fun (ses);}
+  void fulfil (std::promise<void>& promise) {promise.set_value();}
+};
+
+/**
+ * Funnels the writes of many threads through a single thread, which applies the submitted jobs
+ * in transactions ("BEGIN IMMEDIATE") of up to \c maxBatch jobs.\n
+ * The writers of the process no longer compete for the SQLite write lock (nor wait for it), and they share the commits (and the syncs).\n
+ * Every job runs in a SAVEPOINT of its own: a job that throws is rolled back and fails its future, the rest of the batch is committed.
+ * A future becomes ready when the transaction with the job is committed.\n
+ * "BEGIN IMMEDIATE" and "COMMIT" are repeated after SQLITE_BUSY (another process holding the lock), waiting with a SqliteBackoff.\n
+ * The Sqlite must outlive the SqliteWriter. The jobs still queued are applied when the writer is stopped or destroyed.\n
+ * NB: The writer thread opens a (read-write) SqliteSession for every batch, hence a thread holding a read-write SqliteSession
+ * on the same Sqlite must not wait on a writer future: the writer would be waiting for that session's connection, a deadlock.
+ * Usage example: \code
+ *   glim::SqliteWriter writer (&db);
+ *   std::future<int> inserted = writer.submit ([](glim::SqliteSession& ses) {return (ses.query ("INSERT INTO test VALUES (?)") << 1) .ustep();});
+ *   inserted.get();
+ * \endcode
+ */
+class SqliteWriter {
+ protected:
+  struct Job {
+    std::function<void (SqliteSession&)> apply; ///< Runs the job, keeping the result.
+    std::function<void()> committed; ///< Passes the result to the future.
+    std::function<void (std::exception_ptr)> failed;
+  };
+  Sqlite* db;
+  uint32_t maxBatch;
+  SqliteBackoff busy; ///< Waits between the BEGIN and COMMIT attempts on SQLITE_BUSY.
+  std::mutex mutex; std::condition_variable cond; ///< Guard and signal the \c queue.
+  std::deque<Job> queue;
+  bool stopping;
+  std::thread thread;
+
+  static void exec (SqliteSession& ses, const char* sql) {
+    char* errmsg = NULL; ::sqlite3_exec (ses, sql, NULL, NULL, &errmsg);
+    if (errmsg) {std::string err (errmsg); ::sqlite3_free (errmsg); throw SqliteEx (std::string ("SqliteWriter, ") + sql + ": " + err);}
+  }
+  /// Runs the \c sql, repeating it while it fails with SQLITE_BUSY and the \c busy deadline has not passed.
+  void execBusy (SqliteSession& ses, const char* sql) {
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    for (int attempt = 0;; ++attempt) {
+      char* errmsg = NULL; int ret = ::sqlite3_exec (ses, sql, NULL, NULL, &errmsg);
+      if ((ret & 0xFF) == SQLITE_BUSY && busy.wait (attempt, started)) {::sqlite3_free (errmsg); continue;}
+      if (errmsg) {std::string err (errmsg); ::sqlite3_free (errmsg); throw SqliteEx (std::string ("SqliteWriter, ") + sql + ": " + err);}
+      return;
+    }
+  }
+  /// Applies the \c jobs in a single transaction.
+  void apply (std::vector<Job>& jobs) {
+    enum State {pending, applied, failed};
+    std::vector<State> states (jobs.size(), pending);
+    SqliteSession ses (db);
+    try {
+      execBusy (ses, "BEGIN IMMEDIATE");
+      for (size_t num = 0; num < jobs.size(); ++num) {
+        exec (ses, "SAVEPOINT job");
+        try {
+          jobs[num].apply (ses);
+          exec (ses, "RELEASE job");
+          states[num] = applied;
+        } catch (...) {
+          states[num] = failed; jobs[num].failed (std::current_exception());
+          exec (ses, "ROLLBACK TO job"); exec (ses, "RELEASE job");
+        }
+      }
+      execBusy (ses, "COMMIT");
+    } catch (...) {
+      if (!::sqlite3_get_autocommit (ses)) ::sqlite3_exec (ses, "ROLLBACK", NULL, NULL, NULL);
+      for (size_t num = 0; num < jobs.size(); ++num) if (states[num] != failed) jobs[num].failed (std::current_exception());
+      return;
     }
-    if (ret == SQLITE_BUSY) for (int repeat = this->repeat; ret == SQLITE_BUSY && repeat >= 0; --repeat) {
-      //struct timespec ts; ts.tv_sec = 0; ts.tv_nsec = wait * 1000000; // nan is 10^-9 of sec.
-      //while (::nanosleep (&ts, &ts) == EINTR);
-      ::sqlite3_sleep (wait);
-      ret = ::sqlite3_step (statement);
+    for (size_t num = 0; num < jobs.size(); ++num) if (states[num] == applied) jobs[num].committed();
+  }
+  void loop () {
+    std::vector<Job> jobs;
+    for (;;) {
+      {std::unique_lock<std::mutex> lock (mutex);
+        cond.wait (lock, [this]() {return stopping || !queue.empty();});
+        if (queue.empty()) return; // Stopped and drained.
+        jobs.clear();
+        while (!queue.empty() && jobs.size() < maxBatch) {jobs.push_back (std::move (queue.front())); queue.pop_front();}}
+      apply (jobs);
     }
-    throw SqliteEx (std::string(query, queryLength) + ::sqlite3_errmsg(*session));
   }
+  /** Shan't copy. */
+  SqliteWriter (const SqliteWriter& other) = delete;
+ public:
+  /**
+   * @param maxBatch The maximum number of jobs in a single transaction.
+   * @param busy How long and how often to repeat "BEGIN IMMEDIATE" and "COMMIT" returning SQLITE_BUSY.
+   */
+  SqliteWriter (Sqlite* db, uint32_t maxBatch = 256, const SqliteBackoff& busy = SqliteBackoff())
+    : db (db), maxBatch (maxBatch ? maxBatch : 1), busy (busy), stopping (false) {
+    thread = std::thread (&SqliteWriter::loop, this);
+  }
+  /**
+   * Queues the \c job (SqliteSession&) for the writer thread.
+   * @return The future of the \c job result, ready after the commit.
+   */
+  template <typename Fun> auto submit (Fun job) -> std::future<decltype (job (std::declval<SqliteSession&>()))> {
+    typedef decltype (job (std::declval<SqliteSession&>())) R;
+    std::shared_ptr<std::promise<R> > promise (new std::promise<R>());
+    std::shared_ptr<SqliteWriterResult<R> > result (new SqliteWriterResult<R>());
+    Job entry;
+    entry.apply = [job,result] (SqliteSession& ses) mutable {result->apply (job, ses);};
+    entry.committed = [promise,result]() {result->fulfil (*promise);};
+    entry.failed = [promise] (std::exception_ptr ex) {promise->set_exception (ex);};
+    std::future<R> future (promise->get_future());
+    {std::lock_guard<std::mutex> lock (mutex);
+      if (stopping) throw SqliteEx ("SqliteWriter: stopped");
+      queue.push_back (std::move (entry));}
+    cond.notify_one();
+    return future;
+  }
+  /// Applies the queued jobs and stops the writer thread.
+  void stop () {
+    {std::lock_guard<std::mutex> lock (mutex); stopping = true;}
+    cond.notify_all();
+    if (thread.joinable()) thread.join();
+  }
+  ~SqliteWriter () {stop();}
 };
 
 template <typename T>
@@ -533,6 +1299,14 @@ SqliteQuery SqliteSession::query (T t) {
   return SqliteQuery (this, t);
 }
 
+template <typename... Ts, typename T, typename... Args>
+SqliteRows<Ts...> SqliteSession::rows (T t, Args... args) {
+  SqliteQuery query (this, t);
+  int expand[] = {0, ((void) (query << args), 0)...};
+  (void) expand;
+  return SqliteRows<Ts...> (std::move (query));
+}
+
 }; // namespace glim
 
 #endif // GLIM_SQLITE_HPP_
@@ -1,9 +1,11 @@
 #include "ldb.hpp"
 using glim::Ldb;
 using glim::gstring;
+using glim::ExternalSort;
 #include <iostream>
 using std::cout; using std::flush; using std::endl;
 #include <assert.h>
+#include <limits.h>
 #include <boost/filesystem.hpp>
 
 void test1 (Ldb& ldb) {
@@ -146,6 +148,253 @@ void testStartsWith (Ldb& ldb) {
 
   { auto range = ldb.range (C2GSTRING ("0"), C2GSTRING ("1"));  // 01 and 02, but not 11.
     count = 0; for (auto& en: range) {en.keyView(); ++count;} assert (count == 2); }
+
+  count = 0; for (auto cur = ldb.cursor (C2GSTRING ("0"), C2GSTRING ("2"), false); cur.valid(); cur.next()) {
+    assert (cur.keyView() == (count ? (count == 1 ? "02" : "11") : "01")); ++count;}
+  assert (count == 3);
+  count = 0; for (auto cur = ldb.prefixCursor (C2GSTRING ("2")); cur.valid(); cur.next()) ++count; assert (count == 3);
+  count = 0; for (auto cur = ldb.prefixCursor (C2GSTRING ("3")); cur.valid(); cur.next()) ++count; assert (count == 0);
+  count = 0; for (auto cur = ldb.cursor(); cur.valid(); cur.next()) ++count; assert (count == 6);
+}
+
+void testParallelRange (Ldb& ldb) {
+  const std::string filler (100, 'f');
+  for (uint32_t ui = 0; ui < 1000; ++ui) ldb.put (ui, std::to_string (ui) + filler);
+  ldb._db->CompactRange (nullptr, nullptr); // Moves the data out of the memtable, where `GetApproximateSizes` sees nothing.
+  int64_t expected = 0; for (auto& en: ldb.range ((uint32_t) 100, (uint32_t) 900)) expected += std::stoi (en.getValue<std::string>());
+  auto sum = [](int64_t& sum, Ldb::IteratorEntry& entry) {sum += std::stoi (entry.getValue<std::string>());};
+  auto add = [](int64_t& total, int64_t& partial) {total += partial;};
+  assert (ldb.parallelRange ((uint32_t) 100, (uint32_t) 900, (int64_t) 0, (int64_t) 0, sum, add, 4) == expected);
+  assert (ldb.parallelRange ((uint32_t) 100, (uint32_t) 900, (int64_t) 0, (int64_t) 0, sum, add, 1) == expected);
+  assert (ldb.parallelRange ((uint32_t) 900, (uint32_t) 100, (int64_t) 0, (int64_t) 0, sum, add, 3) == 0);
+  assert (ldb.parallelRange ((uint32_t) 100, (uint32_t) 900, (int64_t) 1000, (int64_t) 0, sum, add, 4) == expected + 1000); // `init` is counted once.
+  auto least = [](int& least, Ldb::IteratorEntry& entry) {least = std::min (least, std::stoi (entry.getValue<std::string>()));};
+  auto lesser = [](int& least, int& partial) {least = std::min (least, partial);};
+  assert (ldb.parallelRange ((uint32_t) 100, (uint32_t) 900, 500, INT_MAX, least, lesser, 4) == 100);
+
+  // The split follows the data on disk: the sub-ranges get about the same number of records.
+  char fbuf[4] = {0, 0, 0, 100}, tbuf[4] = {0, 0, 3, (char) 132};
+  auto bounds = ldb.splitRange (gstring (fbuf, 4), gstring (tbuf, 4), 4);
+  assert (bounds.size() >= 2 && bounds.size() <= 5);
+  for (size_t bn = 1; bn < bounds.size(); ++bn) assert (leveldb::Slice (bounds[bn - 1].data(), bounds[bn - 1].size())
+    .compare (leveldb::Slice (bounds[bn].data(), bounds[bn].size())) < 0);
+  assert (bounds.size() == 5);
+  for (size_t bn = 1; bn < bounds.size(); ++bn) {
+    int count = 0; for (auto& en: ldb.range (bounds[bn - 1], bounds[bn])) {en.keyView(); ++count;}
+    assert (count > 800 / 4 / 2 && count < 800 / 4 * 2);
+  }
+
+  for (uint32_t ui = 0; ui < 1000; ++ui) ldb.del (ui);
+}
+
+void testGetMulti (Ldb& ldb) {
+  for (uint32_t ui = 0; ui < 100; ui += 2) ldb.put (ui, (int) ui * 10);
+  std::vector<uint32_t> keys {42, 7, 0, 98, 42, 99, 1000};
+  std::vector<int> values; std::vector<bool> found;
+  for (uint32_t denseBytes: {0u, UINT32_MAX}) { // Point lookups, then the iterator.
+    values.clear();
+    assert (ldb.getMulti (keys, values, found, leveldb::ReadOptions(), denseBytes) == 4);
+    assert (values.size() == keys.size() && found.size() == keys.size());
+    assert (found[0] && values[0] == 420); assert (!found[1]); assert (found[2] && values[2] == 0);
+    assert (found[3] && values[3] == 980); assert (found[4] && values[4] == 420); assert (!found[5] && !found[6]);
+  }
+  for (uint32_t ui = 0; ui < 100; ui += 2) ldb.del (ui);
+}
+
+void testExternalSort() {
+  ExternalSort sort (64, "/tmp", false, 3); // Dozens of runs, merged three at a time.
+  for (uint32_t ui = 0; ui < 500; ++ui) {
+    char key[16]; snprintf (key, sizeof (key), "%03u", (ui * 7919) % 100);
+    sort.add (key, 3, (const char*) &ui, sizeof (ui));}
+  assert (sort._runs.size() > 9);
+  uint32_t count = 0; std::string prevKey; uint32_t prevValue = 0;
+  sort.merge ([&] (const gstring& key, const gstring& value) {
+    uint32_t ui; memcpy (&ui, value.data(), sizeof (ui));
+    std::string skey (key.data(), key.size());
+    assert (skey >= prevKey);
+    if (skey == prevKey) assert (ui > prevValue); // Stable.
+    prevKey = skey; prevValue = ui; ++count;});
+  assert (count == 500 && sort._runs.empty());
+  bool thrown = false; try {std::string big (ExternalSort::maxLength + 1, 'x'); sort.add ("k", 1, big.data(), big.size());} catch (const glim::ExternalSortEx&) {thrown = true;}
+  assert (thrown);
+}
+
+void testBulkLoader (Ldb& ldb) {
+  auto loader = ldb.bulkLoader (256, 64); // Small limits in order to test the spilling and the batching.
+  uint64_t progress = 0; loader._progress = [&](uint64_t records, uint64_t) {assert (records > progress); progress = records;};
+  for (uint32_t ui = 0; ui < 300; ++ui) loader.put ((ui * 7919) % 300, (int) ui);
+  loader.put ((uint32_t) 0, -1); // Overwrites the first value of `0`.
+  assert (loader.finish() == 301); assert (progress == 301);
+  int value = 0; uint32_t count = 0, prev = 0;
+  for (auto& en: ldb) {uint32_t key = en.getKey<uint32_t>(); assert (count == 0 || key > prev); prev = key; ++count;}
+  assert (count == 300);
+  assert (ldb.get ((uint32_t) 0, value) && value == -1);
+  assert (ldb.get ((uint32_t) ((7 * 7919) % 300), value) && value == 7);
+  for (uint32_t ui = 0; ui < 300; ++ui) ldb.del (ui);
+}
+
+/// Indexes `value -> key` on a background thread.
+struct ValueIndex: public Ldb::AsyncTrigger {
+  virtual gstring triggerName() const override {return C2GSTRING ("valueIndex");}
+  virtual bool wantsOldValues() const override {return true;}
+  virtual void apply (Ldb& ldb, const Ldb::Change& change, leveldb::WriteBatch& batch) override {
+    GSTRING_ON_STACK (ikey, 64);
+    if (change._hadOld) {ikey << "idx:" << change._oldValue; batch.Delete (leveldb::Slice (ikey.data(), ikey.size()));}
+    if (change._op == 'P') {
+      ikey.clear() << "idx:" << change._value;
+      batch.Put (leveldb::Slice (ikey.data(), ikey.size()), leveldb::Slice (change._key.data(), change._key.size()));}
+  }
+};
+
+void testAsyncTriggers (Ldb& ldb) {
+  Ldb older (ldb); // Copied before the change log is enabled.
+  ldb.putAsyncTrigger (std::make_shared<ValueIndex>());
+  ldb.put (C2GSTRING ("k1"), C2GSTRING ("v1"));
+  ldb.put (C2GSTRING ("k2"), C2GSTRING ("v2"));
+  ldb.put (C2GSTRING ("k1"), C2GSTRING ("v3"));
+  ldb.del (C2GSTRING ("k2"));
+  ldb.waitForIndexes(); assert (ldb.indexLag() == 0);
+  gstring ik;
+  assert (ldb.get (C2GSTRING ("idx:v3"), ik) && ik == "k1");
+  assert (!ldb.have (C2GSTRING ("idx:v1"))); assert (!ldb.have (C2GSTRING ("idx:v2")));
+  older.put (C2GSTRING ("k5"), C2GSTRING ("v5"));
+  ldb.waitForIndexes(); assert (ldb.get (C2GSTRING ("idx:v5"), ik) && ik == "k5");
+
+  // Changes made while the trigger is stopped are applied when it is back.
+  ldb.stopAsyncTriggers();
+  ldb.put (C2GSTRING ("k4"), C2GSTRING ("v4"));
+  ldb.putAsyncTrigger (std::make_shared<ValueIndex>());
+  ldb.waitForIndexes();
+  assert (ldb.get (C2GSTRING ("idx:v4"), ik) && ik == "k4");
+  ldb.stopAsyncTriggers (false); // No consumer is left for the log.
+  assert (!ldb._changes->_enabled);
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "chg")) .valid());
+  ldb.put (C2GSTRING ("k6"), C2GSTRING ("v6"));
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "chg")) .valid());
+  for (auto key: {"k1", "k4", "k5", "k6"}) ldb.del (C2GSTRING (key));
+}
+
+void testBackgroundThreads() {
+  boost::filesystem::remove_all ("/dev/shm/ldbTestThreads");
+  std::weak_ptr<leveldb::DB> db;
+  {Ldb ldb ("/dev/shm/ldbTestThreads");
+    ldb.startExpirySweeper (3600); ldb.startConsolidation (3600);
+    ldb.putAsyncTrigger (std::make_shared<ValueIndex>());
+    db = ldb._db;}
+  assert (db.expired()); // The threads were joined and the database closed.
+  boost::filesystem::remove_all ("/dev/shm/ldbTestThreads");
+}
+
+void testOptions() {
+  boost::filesystem::remove_all ("/dev/shm/ldbTestOptions");
+  Ldb ldb ("/dev/shm/ldbTestOptions", Ldb::Options().cacheMb (1) .writeBufferMb (1) .blockSize (1024) .bloomBits (10) .compression (false));
+  ldb.put (C2GSTRING ("foo"), C2GSTRING ("bar"));
+  gstring value; for (int num = 0; num < 3; ++num) assert (ldb.get (C2GSTRING ("foo"), value) && value == "bar");
+  Ldb::Stats stats (ldb.stats());
+  assert (stats._cacheCapacity == 1024 * 1024);
+  assert (stats.cacheHitRate() >= 0.0 && stats.cacheHitRate() <= 1.0);
+  assert (!stats._filesAtLevel.empty());
+  assert (!ldb.property ("leveldb.stats") .empty()); assert (ldb.property ("no.such.property") .empty());
+  ldb._db.reset();
+  boost::filesystem::remove_all ("/dev/shm/ldbTestOptions");
+}
+
+void testExpiring (Ldb& ldb) {
+  ldb.putExpiring (C2GSTRING ("e1"), C2GSTRING ("v1"), 100);
+  ldb.putExpiring (C2GSTRING ("e2"), C2GSTRING ("v2"), 0); // Expires right away.
+  ldb.putExpiring (C2GSTRING ("e3"), C2GSTRING ("v3"), 0);
+  ldb.putExpiring (C2GSTRING ("e3"), C2GSTRING ("v3"), 200); // Rewritten with a new TTL.
+  gstring value;
+  assert (ldb.getLive (C2GSTRING ("e1"), value) && value == "v1");
+  assert (!ldb.getLive (C2GSTRING ("e2"), value));
+  assert (ldb.getLive (C2GSTRING ("e3"), value) && value == "v3");
+  gstring vbytes (ldb.cursor (C2GSTRING ("e1"), C2GSTRING ("e2")) .valueView());
+  assert (Ldb::liveValue (vbytes, time (nullptr)) && vbytes == "v1");
+
+  assert (ldb.purgeExpired() == 1); // e2; the first e3 index entry is stale.
+  assert (!ldb.have (C2GSTRING ("e2"))); assert (ldb.have (C2GSTRING ("e3")));
+  assert (ldb.expiredKeys() == 1 && ldb.expiredBytes() > 0);
+  assert (ldb.purgeExpired (time (nullptr) + 150) == 1); // e1.
+  assert (ldb.purgeExpired (time (nullptr) + 250) == 1); // e3.
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "ttl")) .valid()); // No index entries left.
+
+  // A key rewritten while its old value is being purged keeps the new value.
+  std::atomic<bool> done (false);
+  std::thread purger ([&]() {while (!done) ldb.purgeExpired (time (nullptr) + 1);});
+  for (int num = 0; num < 2000; ++num) {
+    ldb.putExpiring (C2GSTRING ("e4"), C2GSTRING ("old"), 0);
+    ldb.putExpiring (C2GSTRING ("e4"), C2GSTRING ("new"), 100);
+    assert (ldb.getLive (C2GSTRING ("e4"), value) && value == "new");
+  }
+  done = true; purger.join();
+  ldb.purgeExpired (time (nullptr) + 200);
+  assert (!ldb.have (C2GSTRING ("e4")));
+  assert (ldb.expirySweeperError() == nullptr);
+}
+
+void testMerge (Ldb& ldb) {
+  ldb.setMerger (Ldb::makeMerger<int32_t, int32_t> ([](int32_t& counter, int32_t inc) {counter += inc;}));
+  for (int32_t inc = 1; inc <= 10; ++inc) ldb.merge (std::string ("counter"), inc);
+  int32_t counter = 0;
+  assert (ldb.getMerged (std::string ("counter"), counter) && counter == 55);
+  assert (!ldb.have (std::string ("counter"))); // Not yet consolidated.
+  assert (ldb.consolidate() == 1);
+  assert (ldb.get (std::string ("counter"), counter) && counter == 55);
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "mrg")) .valid()); // Operands are gone.
+  ldb.merge (std::string ("counter"), 45);
+  assert (ldb.getMerged (std::string ("counter"), counter) && counter == 100);
+
+  std::vector<std::thread> threads;
+  for (int th = 0; th < 4; ++th) threads.emplace_back ([&ldb]() {
+    for (int num = 0; num < 1000; ++num) ldb.update<std::string, int32_t> (std::string ("counter"), [](int32_t& counter, bool exists) {
+      assert (exists); ++counter; return true;});});
+  for (auto& thread: threads) thread.join();
+  assert (ldb.get (std::string ("counter"), counter) && counter == 4100); // The `update` folds the pending operand.
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "mrg")) .valid());
+  ldb.del (std::string ("counter"));
+
+  // The operand order survives a restart (fresh merging state), the sequence going on from the reserved block.
+  ldb.setMerger (Ldb::makeMerger<std::string, std::string> ([](std::string& str, const std::string& suffix) {str += suffix;}));
+  ldb.merge (std::string ("str"), std::string ("a"));
+  const uint64_t seq = ldb._merging->_seq;
+  ldb._merging = std::make_shared<Ldb::Merging>();
+  ldb.setMerger (Ldb::makeMerger<std::string, std::string> ([](std::string& str, const std::string& suffix) {str += suffix;}));
+  ldb.merge (std::string ("str"), std::string ("b"));
+  assert (ldb._merging->_seq > seq);
+  std::string str; assert (ldb.getMerged (std::string ("str"), str) && str == "ab");
+  assert (ldb.consolidate() == 1 && ldb.get (std::string ("str"), str) && str == "ab");
+  ldb.del (std::string ("str"));
+  assert (ldb.consolidationError() == nullptr);
+}
+
+void testCheckpoint (Ldb& ldb) {
+  const std::string dir ("/dev/shm/ldbTestCheckpoint");
+  boost::filesystem::remove_all (dir);
+  ldb.retainChanges();
+  ldb.put (std::string ("cp1"), 1); ldb.put (std::string ("cp2"), 2);
+  const uint64_t seq = ldb.checkpoint (dir);
+  ldb.put (std::string ("cp3"), 3); ldb.del (std::string ("cp1"));
+  std::stringstream changes;
+  assert (ldb.exportChanges (seq, changes) == seq + 2);
+  {
+    Ldb replica (dir.c_str());
+    int32_t value = 0;
+    assert (replica.get (std::string ("cp1"), value) && value == 1); assert (!replica.have (std::string ("cp3")));
+    assert (replica.importChanges (changes) == 2);
+    assert (!replica.have (std::string ("cp1"))); assert (replica.get (std::string ("cp3"), value) && value == 3);
+    assert (replica.importedChanges() == seq + 2);
+    changes.clear(); changes.seekg (0);
+    assert (replica.importChanges (changes) == 0); // Already imported.
+  }
+  ldb.retainChanges (seq + 2); // The replica has caught up.
+  std::stringstream stale; bool thrown = false;
+  try {ldb.exportChanges (seq, stale);} catch (const glim::LdbEx&) {thrown = true;}
+  assert (thrown);
+  ldb.releaseChanges(); // Turns the log off, there being no async triggers.
+  assert (!ldb._changes->_enabled);
+  assert (!ldb.prefixCursor (C2GSTRING ("\xFF" "glim" "\xFF" "chg")) .valid());
+  for (auto key: {"cp2", "cp3"}) ldb.del (std::string (key));
+  boost::filesystem::remove_all (dir);
 }
 
 int main() {
@@ -158,7 +407,19 @@ int main() {
   for (auto& en: ldb) ldb.del (en.keyView());
   testStartsWith (ldb);
 
+  for (auto& en: ldb) ldb.del (en.keyView());
+  testParallelRange (ldb);
+  testGetMulti (ldb);
+  testExternalSort();
+  testBulkLoader (ldb);
+  testAsyncTriggers (ldb);
+  testExpiring (ldb);
+  testMerge (ldb);
+  testCheckpoint (ldb);
+
   ldb._db.reset(); // Close.
+  testOptions();
+  testBackgroundThreads();
   boost::filesystem::remove_all ("/dev/shm/ldbTest");
   cout << "pass." << endl;
   return 0;
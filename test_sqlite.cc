@@ -1,4 +1,5 @@
 
+#include "gstring.hpp"
 #include "sqlite.hpp"
 #define S(cstr) (std::pair<char const*, int> (cstr, sizeof (cstr) - 1))
 #include <assert.h>
@@ -13,6 +14,131 @@ int main () {
   assert (sqs.query ("INSERT INTO test VALUES (?, ?)") .bind (1, S("foo")) .bind (2, 27) .ustep() == 1);
   assert (sqs.query ("SELECT t FROM test") .qstep() .stringAt (1) == "foo");
   assert (sqs.query ("SELECT i FROM test") .qstep() .intAt (1) == 27);
+
+  // Statement cache.
+  uint64_t misses = sqlite.statementCacheMisses(), hits = sqlite.statementCacheHits();
+  for (int num = 0; num < 10; ++num) assert ((sqs.query ("SELECT count(*) FROM test WHERE i = ?") << 27) .qstep() .intAt (1) == 1);
+  assert (sqlite.statementCacheMisses() == misses + 1);
+  assert (sqlite.statementCacheHits() == hits + 9);
+  assert (sqs.query ("SELECT count(*) FROM test WHERE i = ?") .qstep() .intAt (1) == 0); // The bindings were cleared.
+
+  // Bulk insert.
+  sqs.query ("CREATE TABLE bulk (t TEXT, i INTEGER)") .ustep();
+  {SqliteBulkInsert insert (&sqs, "INSERT INTO bulk (t, i)", 2, 16, 100);
+    for (int num = 0; num < 1005; ++num) insert << std::string ("row") << num;
+    assert (insert.finish() == 1005);
+    assert (insert.rowsPerSecond() > 0);}
+  {SqliteQuery totals (sqs.query ("SELECT count(*), sum(i) FROM bulk")); totals.qstep();
+    assert (totals.intAt (1) == 1005 && totals.int64at (2) == 1004 * 1005 / 2);}
+  assert (::sqlite3_get_autocommit (sqs));
+  sqs.query ("CREATE TABLE bulkTypes (t TEXT, i INTEGER)") .ustep();
+  {SqliteBulkInsert insert (&sqs, "INSERT INTO bulkTypes (t, i)", 2, 2, 100);
+    const std::string longText (100, 'l'); const char* literal = "literal";
+    insert << longText << (int64_t) 1 << literal << 2.0 << std::make_pair (literal, 3) << 'c';
+    assert (insert.finish() == 3);
+    assert ((sqs.query ("SELECT i FROM bulkTypes WHERE t = ?") << longText) .qstep() .intAt (1) == 1);}
+  assert ((sqs.query ("SELECT i FROM bulkTypes WHERE t = ?") << std::string ("literal")) .qstep() .intAt (1) == 2);
+  assert ((sqs.query ("SELECT i FROM bulkTypes WHERE t = ?") << std::string ("lit")) .qstep() .intAt (1) == 'c');
+
+  // Blobs, doubles and gstrings.
+  sqs.query ("CREATE TABLE blobs (b BLOB, d REAL)") .ustep();
+  const char binary[] = {'a', 0, 'b', '\xFF'};
+  sqs.query ("INSERT INTO blobs VALUES (?, ?)") .bindBlob (1, binary, sizeof (binary)) .bind (2, 2.5) .ustep();
+  {SqliteQuery select (sqs.query ("SELECT b, d FROM blobs")); select.qstep();
+    std::pair<const void*, int> blob = select.blobAt (1);
+    assert (blob.second == 4 && ::memcmp (blob.first, binary, 4) == 0);
+    gstring view (select.gstringAt (1));
+    assert (view.size() == 4 && view.data() == blob.first);
+    assert (select.doubleAt (2) == 2.5);}
+  assert ((sqs.query ("SELECT count(*) FROM test WHERE t = ?") << C2GSTRING ("foo")) .qstep() .intAt (1) == 1);
+  {gstring foo ("foo"); assert (sqs.query ("SELECT count(*) FROM test WHERE t = ?") .bind (1, foo, false) .qstep() .intAt (1) == 1);}
+  sqs.query ("INSERT INTO blobs VALUES (?, 0)") .bindZeroBlob (1, 1000) .ustep();
+  {SqliteBlob blob (&sqs, "blobs", "b", ::sqlite3_last_insert_rowid (sqs), true);
+    assert (blob.size() == 1000);
+    blob.write ("xyz", 3, 997);
+    char tail[3]; blob.read (tail, 3, 997);
+    assert (::memcmp (tail, "xyz", 3) == 0);}
+
+  // Typed rows.
+  {int count = 0; int64_t sum = 0;
+    for (auto row: sqs.rows<int64_t, gstring, double> ("SELECT i, t, i * 0.5 FROM bulk WHERE i >= ?", 1000)) {
+      assert (std::get<1> (row) == "row" && std::get<2> (row) == std::get<0> (row) * 0.5);
+      ++count; sum += std::get<0> (row);}
+    assert (count == 5 && sum == 1000 + 1001 + 1002 + 1003 + 1004);}
+  for (auto row: sqs.rows<std::string, int> (S("SELECT t, i FROM test"))) assert (row == std::make_tuple (std::string ("foo"), 27));
+  assert (sqs.query ("SELECT i, t FROM test") .qstep() .at<std::string> (2) == "foo");
+  {struct Item {int64_t id; std::string name; double half;};
+    std::vector<Item> items;
+    assert ((sqs.query ("SELECT i, t, i * 0.5 FROM bulk WHERE i < ? ORDER BY i") << 10) .fill (items, &Item::id, &Item::name, &Item::half) == 10);
+    assert (items.size() == 10 && items[9].id == 9 && items[9].name == "row" && items[9].half == 4.5);}
+
+  // WAL with the reader connections.
+  const std::string path ("/tmp/libglim_test_sqlite.db");
+  for (std::string suffix: {"", "-wal", "-shm"}) ::unlink ((path + suffix) .c_str());
+  {Sqlite pooled (path);
+    pooled.pool (2);
+    {SqliteSession ses (&pooled);
+      ses.query ("CREATE TABLE test (i INTEGER)") .ustep();
+      ses.query ("INSERT INTO test VALUES (1)") .ustep();
+      ses.query ("BEGIN") .ustep();
+      ses.query ("INSERT INTO test VALUES (2)") .ustep();
+      {SqliteSession reader (&pooled, SqliteSession::readOnly); // Doesn't wait for the writer.
+        assert (reader.query ("SELECT count(*) FROM test") .qstep() .intAt (1) == 1);
+        SqliteSession reader2 (&pooled, SqliteSession::readOnly);
+        assert ((::sqlite3*) reader2 != (::sqlite3*) reader);
+        bool thrown = false; try {reader.query ("INSERT INTO test VALUES (3)") .ustep();} catch (const SqliteEx&) {thrown = true;}
+        assert (thrown);}
+      ses.query ("COMMIT") .ustep();}
+    {SqliteSession reader (&pooled, SqliteSession::readOnly);
+      assert (reader.query ("SELECT count(*) FROM test") .qstep() .intAt (1) == 2);}
+    assert (pooled.checkpoint (SQLITE_CHECKPOINT_TRUNCATE) .second == 0);
+    // Readers added and configured while the read-only sessions run.
+    std::atomic<bool> done (false); std::vector<std::thread> threads;
+    const uint64_t hits = pooled.statementCacheHits();
+    for (int th = 0; th < 4; ++th) threads.emplace_back ([&]() {
+      for (int num = 0; num < 50 || !done; ++num) {SqliteSession reader (&pooled, SqliteSession::readOnly);
+        assert (reader.query ("SELECT count(*) FROM test") .qstep() .intAt (1) == 2);}});
+    for (int num = 0; num < 8; ++num) {pooled.pool (1); pooled.setStatementCache (16 + num); pooled.statementCacheHits();}
+    done = true; for (auto& thread: threads) thread.join();
+    assert (pooled.statementCacheHits() > hits);}
+  for (std::string suffix: {"", "-wal", "-shm"}) ::unlink ((path + suffix) .c_str());
+
+  // Busy backoff and the single writer.
+  {Sqlite first (path), second (path);
+    first.exec ("CREATE TABLE test (i INTEGER)");
+    second.busyBackoff (SqliteBackoff (1, 10, 50));
+    {SqliteSession ses (&first);
+      ses.query ("BEGIN IMMEDIATE") .ustep();
+      auto started = std::chrono::steady_clock::now();
+      bool thrown = false; try {second.exec ("INSERT INTO test VALUES (0)");} catch (const SqliteEx&) {thrown = true;}
+      assert (thrown && std::chrono::steady_clock::now() - started >= std::chrono::milliseconds (40));
+      SqliteSession ses2 (&second);
+      thrown = false; try {SqliteParQuery (&ses2, S("INSERT INTO test VALUES (0)"), 5, 4) .step();} catch (const SqliteEx& ex) {
+        thrown = std::string (ex.what()) .find ("INSERT INTO test VALUES (0): ") == 0;}
+      assert (thrown);
+      ses.query ("COMMIT") .ustep();}
+    second.exec ("INSERT INTO test VALUES (0)");
+    std::vector<std::future<int> > inserted;
+    std::future<void> bad;
+    {SqliteWriter writer (&second, 16);
+      for (int num = 1; num <= 100; ++num) {
+        inserted.push_back (writer.submit ([num] (SqliteSession& ses) {return (ses.query ("INSERT INTO test VALUES (?)") << num) .ustep();}));
+        if (num == 50) bad = writer.submit ([] (SqliteSession& ses) {ses.query ("INSERT INTO missing VALUES (1)") .ustep();});
+      }}
+    for (auto& future: inserted) assert (future.get() == 1);
+    bool thrown = false; try {bad.get();} catch (const SqliteEx&) {thrown = true;}
+    assert (thrown);
+    // The writer outwaits a lock held for longer than the busy handler of its connection.
+    std::future<int> late;
+    {SqliteSession ses (&first); ses.query ("BEGIN IMMEDIATE") .ustep();
+      SqliteWriter writer (&second, 16, SqliteBackoff (1, 10, 5000));
+      late = writer.submit ([] (SqliteSession& ses) {return (ses.query ("INSERT INTO test VALUES (?)") << 101) .ustep();});
+      std::this_thread::sleep_for (std::chrono::milliseconds (150));
+      ses.query ("COMMIT") .ustep();}
+    assert (late.get() == 1);
+    SqliteSession ses (&first);
+    assert (ses.query ("SELECT count(*) FROM test") .qstep() .intAt (1) == 102);}
+  for (std::string suffix: {"", "-wal", "-shm"}) ::unlink ((path + suffix) .c_str());
   std::cout << "pass." << std::endl;
   return 0;
 }